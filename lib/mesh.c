@@ -0,0 +1,1391 @@
+//
+//  mesh.c
+//  SoftwareRender
+//
+//  Created by xiaov.
+//
+
+#include "mesh.h"
+#include <math.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX(a, b) (a > b ? a : b)
+#define MIN(a, b) (a < b ? a : b)
+
+// a soft cluster may end once its ACMR is within this factor of the whole hard cluster
+#define MESH_OVERDRAW_THRESHOLD 1.05f
+
+//===================================================================
+//welding
+//===================================================================
+
+#define WELD_MAX_FLOATS 12
+
+// the attributes of one vertex packed into a single key
+typedef struct {
+    const float* arrays[4];
+    int sizes[4];
+    int floats;
+} weld_layout_t;
+
+static int weld_key(const weld_layout_t* layout, int i, float* key) {
+    int n = 0;
+    for (int a = 0; a < 4; a++) {
+        if (!layout->arrays[a]) continue;
+        memcpy(key + n, layout->arrays[a] + i * layout->sizes[a], layout->sizes[a] * sizeof(float));
+        n += layout->sizes[a];
+    }
+    return n;
+}
+
+// FNV-1a over the bits of the key
+static uint32_t weld_hash(const float* key, int floats) {
+    const uint8_t* bytes = (const uint8_t*)key;
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < floats * (int)sizeof(float); i++) {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void mesh_update_bounds(mesh_t* mesh) {
+    for (int k = 0; k < 3; k++) {
+        mesh->bounds_min[k] = mesh->vertex_count ? mesh->vertices[k] : 0;
+        mesh->bounds_max[k] = mesh->bounds_min[k];
+    }
+    for (int v = 1; v < mesh->vertex_count; v++) {
+        for (int k = 0; k < 3; k++) {
+            mesh->bounds_min[k] = MIN(mesh->bounds_min[k], mesh->vertices[v * 3 + k]);
+            mesh->bounds_max[k] = MAX(mesh->bounds_max[k], mesh->vertices[v * 3 + k]);
+        }
+    }
+}
+
+int mesh_weld(mesh_t* mesh, int count, const float* vertices, const float* normals, const float* texcoords, const float* colors) {
+    weld_layout_t layout = {{vertices, normals, texcoords, colors}, {3, 3, 2, 4}, 0};
+    for (int a = 0; a < 4; a++) {
+        if (layout.arrays[a]) layout.floats += layout.sizes[a];
+    }
+
+    memset(mesh, 0, sizeof(mesh_t));
+    if (!vertices || count <= 0) return 0;
+
+    // open addressing at most half full, slots hold welded vertex + 1
+    int capacity = 1;
+    while (capacity < count * 2) capacity <<= 1;
+    int* slots = (int*)calloc(capacity, sizeof(int));
+    float* keys = (float*)malloc(count * layout.floats * sizeof(float));
+    int* first = (int*)malloc(count * sizeof(int));
+
+    mesh->index_count = count;
+    mesh->indices = (int*)malloc(count * sizeof(int));
+
+    int unique = 0;
+    float key[WELD_MAX_FLOATS];
+    for (int i = 0; i < count; i++) {
+        weld_key(&layout, i, key);
+        uint32_t slot = weld_hash(key, layout.floats) & (capacity - 1);
+        while (slots[slot] && memcmp(keys + (slots[slot] - 1) * layout.floats, key, layout.floats * sizeof(float))) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (!slots[slot]) {
+            memcpy(keys + unique * layout.floats, key, layout.floats * sizeof(float));
+            first[unique] = i;
+            slots[slot] = ++unique;
+        }
+        mesh->indices[i] = slots[slot] - 1;
+    }
+
+    // split the keys back into one array per attribute
+    float** outs[4] = {&mesh->vertices, &mesh->normals, &mesh->texcoords, &mesh->colors};
+    for (int a = 0; a < 4; a++) {
+        if (!layout.arrays[a]) continue;
+        int size = layout.sizes[a];
+        float* out = (float*)malloc(unique * size * sizeof(float));
+        for (int v = 0; v < unique; v++) {
+            memcpy(out + v * size, layout.arrays[a] + first[v] * size, size * sizeof(float));
+        }
+        *outs[a] = out;
+    }
+    mesh->vertex_count = unique;
+    mesh_update_bounds(mesh);
+
+    free(first);
+    free(keys);
+    free(slots);
+    return unique;
+}
+
+void mesh_destroy(mesh_t* mesh) {
+    free(mesh->vertices);
+    free(mesh->normals);
+    free(mesh->texcoords);
+    free(mesh->colors);
+    free(mesh->indices);
+    memset(mesh, 0, sizeof(mesh_t));
+}
+
+void mesh_bind(device_t* device, const mesh_t* mesh) {
+    device_vertex_pointer(device, mesh->vertex_count, mesh->vertices);
+    device_normal_pointer(device, mesh->normals);
+    device_texcoord_pointer(device, mesh->texcoords);
+    device_color_pointer(device, mesh->colors);
+    device_vertex_bounds(device, mesh->bounds_min, mesh->bounds_max);
+}
+
+//===================================================================
+//quantized mesh
+//===================================================================
+
+static uint16_t quantize_unorm16(float v) {
+    v = v < 0 ? 0 : v > 1 ? 1 : v;
+    return (uint16_t)(v * 65535.0f + 0.5f);
+}
+
+static int16_t quantize_snorm16(float v) {
+    v = v < -1 ? -1 : v > 1 ? 1 : v;
+    return (int16_t)lrintf(v * 32767.0f);
+}
+
+// project onto the octahedron |x| + |y| + |z| = 1 and fold the lower half over the upper
+static uint32_t encode_octahedral(const float* n) {
+    float l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+    float x = l1 > 0 ? n[0] / l1 : 0;
+    float y = l1 > 0 ? n[1] / l1 : 0;
+    if (n[2] < 0) {
+        float fx = (1 - fabsf(y)) * (x < 0 ? -1 : 1);
+        float fy = (1 - fabsf(x)) * (y < 0 ? -1 : 1);
+        x = fx, y = fy;
+    }
+    return (uint16_t)quantize_snorm16(x) | (uint32_t)(uint16_t)quantize_snorm16(y) << 16;
+}
+
+void mesh_quantize(mesh_quantized_t* out, const mesh_t* mesh) {
+    int n = mesh->vertex_count;
+    memset(out, 0, sizeof(mesh_quantized_t));
+    out->vertex_count = n;
+
+    memcpy(out->bounds_min, mesh->bounds_min, sizeof(out->bounds_min));
+    memcpy(out->bounds_max, mesh->bounds_max, sizeof(out->bounds_max));
+
+    out->vertices = (uint16_t*)malloc(n * 3 * sizeof(uint16_t));
+    for (int v = 0; v < n; v++) {
+        for (int k = 0; k < 3; k++) {
+            float extent = out->bounds_max[k] - out->bounds_min[k];
+            float t = extent > 0 ? (mesh->vertices[v * 3 + k] - out->bounds_min[k]) / extent : 0;
+            out->vertices[v * 3 + k] = quantize_unorm16(t);
+        }
+    }
+
+    if (mesh->normals) {
+        out->normals = (uint32_t*)malloc(n * sizeof(uint32_t));
+        for (int v = 0; v < n; v++) {
+            out->normals[v] = encode_octahedral(mesh->normals + v * 3);
+        }
+    }
+    if (mesh->texcoords && n > 0) {
+        // over the range the mesh uses like positions, uvs that tile past [0, 1] are kept
+        for (int k = 0; k < 2; k++) {
+            out->texcoord_min[k] = out->texcoord_max[k] = mesh->texcoords[k];
+        }
+        for (int v = 1; v < n; v++) {
+            for (int k = 0; k < 2; k++) {
+                out->texcoord_min[k] = MIN(out->texcoord_min[k], mesh->texcoords[v * 2 + k]);
+                out->texcoord_max[k] = MAX(out->texcoord_max[k], mesh->texcoords[v * 2 + k]);
+            }
+        }
+        out->texcoords = (uint16_t*)malloc(n * 2 * sizeof(uint16_t));
+        for (int v = 0; v < n; v++) {
+            for (int k = 0; k < 2; k++) {
+                float extent = out->texcoord_max[k] - out->texcoord_min[k];
+                float t = extent > 0 ? (mesh->texcoords[v * 2 + k] - out->texcoord_min[k]) / extent : 0;
+                out->texcoords[v * 2 + k] = quantize_unorm16(t);
+            }
+        }
+    }
+    if (mesh->colors) {
+        out->colors = (float*)malloc(n * 4 * sizeof(float));
+        memcpy(out->colors, mesh->colors, n * 4 * sizeof(float));
+    }
+
+    out->index_count = mesh->index_count;
+    out->indices = (int*)malloc(mesh->index_count * sizeof(int));
+    memcpy(out->indices, mesh->indices, mesh->index_count * sizeof(int));
+}
+
+void mesh_quantized_destroy(mesh_quantized_t* mesh) {
+    free(mesh->vertices);
+    free(mesh->normals);
+    free(mesh->texcoords);
+    free(mesh->colors);
+    free(mesh->indices);
+    memset(mesh, 0, sizeof(mesh_quantized_t));
+}
+
+void mesh_quantized_bind(device_t* device, const mesh_quantized_t* mesh) {
+    device_vertex_pointer_u16(device, mesh->vertex_count, mesh->vertices, mesh->bounds_min, mesh->bounds_max);
+    if (mesh->normals) {
+        device_normal_pointer_oct(device, mesh->normals);
+    }
+    else {
+        device_normal_pointer(device, NULL);
+    }
+    if (mesh->texcoords) {
+        device_texcoord_pointer_u16(device, mesh->texcoords, mesh->texcoord_min, mesh->texcoord_max);
+    }
+    else {
+        device_texcoord_pointer(device, NULL);
+    }
+    device_color_pointer(device, mesh->colors);
+}
+
+//===================================================================
+//binary mesh file
+//===================================================================
+
+static const int stream_floats[MESH_STREAM_COUNT] = {3, 3, 2, 4, 0};
+
+static void mesh_streams(const mesh_t* mesh, const void* data[MESH_STREAM_COUNT], uint32_t size[MESH_STREAM_COUNT]) {
+    data[MESH_STREAM_POSITION] = mesh->vertices;
+    data[MESH_STREAM_NORMAL] = mesh->normals;
+    data[MESH_STREAM_TEXCOORD] = mesh->texcoords;
+    data[MESH_STREAM_COLOR] = mesh->colors;
+    data[MESH_STREAM_INDEX] = mesh->indices;
+    for (int i = 0; i < MESH_STREAM_COUNT; i++) {
+        size[i] = stream_floats[i] * mesh->vertex_count * sizeof(float);
+    }
+    size[MESH_STREAM_INDEX] = mesh->index_count * sizeof(int32_t);
+}
+
+int mesh_save(const mesh_t* mesh, const char* path) {
+    FILE* fp = fopen(path, "wb");
+    if (!fp) return -1;
+
+    const void* data[MESH_STREAM_COUNT];
+    uint32_t size[MESH_STREAM_COUNT];
+    mesh_streams(mesh, data, size);
+
+    mesh_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MESH_FILE_MAGIC;
+    header.version = MESH_FILE_VERSION;
+    header.vertex_count = mesh->vertex_count;
+    header.index_count = mesh->index_count;
+    memcpy(header.bounds_min, mesh->bounds_min, sizeof(header.bounds_min));
+    memcpy(header.bounds_max, mesh->bounds_max, sizeof(header.bounds_max));
+
+    uint32_t offset = (sizeof(header) + MESH_FILE_ALIGN - 1) & ~(MESH_FILE_ALIGN - 1);
+    for (int i = 0; i < MESH_STREAM_COUNT; i++) {
+        if (!data[i] || !size[i]) continue;
+        header.streams[i].offset = offset;
+        header.streams[i].size = size[i];
+        offset = (offset + size[i] + MESH_FILE_ALIGN - 1) & ~(MESH_FILE_ALIGN - 1);
+    }
+
+    static const uint8_t padding[MESH_FILE_ALIGN] = {0};
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    size_t position = sizeof(header);
+    for (int i = 0; i < MESH_STREAM_COUNT && ok; i++) {
+        if (!header.streams[i].offset) continue;
+        size_t pad = header.streams[i].offset - position;
+        ok = fwrite(padding, 1, pad, fp) == pad;
+        ok = ok && fwrite(data[i], 1, size[i], fp) == size[i];
+        position = header.streams[i].offset + size[i];
+    }
+
+    ok = fclose(fp) == 0 && ok;
+    return ok ? 0 : -1;
+}
+
+// the stream if it is aligned, inside the file and as large as the counts say, NULL otherwise
+static void* mesh_file_stream(const mesh_file_header_t* header, const uint8_t* data, size_t size, int stream, int* valid) {
+    const mesh_stream_t* s = &header->streams[stream];
+    if (!s->offset) return NULL;
+
+    // in 64 bits so a huge count can not wrap around to the stream size
+    uint64_t expected = stream == MESH_STREAM_INDEX ? (uint64_t)header->index_count * sizeof(int32_t)
+                                                    : (uint64_t)stream_floats[stream] * header->vertex_count * sizeof(float);
+    if (s->offset % MESH_FILE_ALIGN || s->size != expected || (uint64_t)s->offset + s->size > size) {
+        *valid = 0;
+        return NULL;
+    }
+    return (void*)(data + s->offset);
+}
+
+int mesh_map(mesh_file_t* file, const char* path) {
+    memset(file, 0, sizeof(mesh_file_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(mesh_file_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    // pages are only read in when a draw touches them
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    const mesh_file_header_t* header = (const mesh_file_header_t*)data;
+    int valid = header->magic == MESH_FILE_MAGIC && header->version == MESH_FILE_VERSION;
+    // counts have to fit the int fields of mesh_t and indices come three per triangle
+    valid = valid && header->vertex_count <= INT_MAX && header->index_count <= INT_MAX && header->index_count % 3 == 0;
+
+    mesh_t* mesh = &file->mesh;
+    if (valid) {
+        mesh->vertex_count = header->vertex_count;
+        mesh->index_count = header->index_count;
+        mesh->vertices = (float*)mesh_file_stream(header, data, st.st_size, MESH_STREAM_POSITION, &valid);
+        mesh->normals = (float*)mesh_file_stream(header, data, st.st_size, MESH_STREAM_NORMAL, &valid);
+        mesh->texcoords = (float*)mesh_file_stream(header, data, st.st_size, MESH_STREAM_TEXCOORD, &valid);
+        mesh->colors = (float*)mesh_file_stream(header, data, st.st_size, MESH_STREAM_COLOR, &valid);
+        mesh->indices = (int*)mesh_file_stream(header, data, st.st_size, MESH_STREAM_INDEX, &valid);
+        valid = valid && mesh->vertices && (mesh->indices || !mesh->index_count);
+    }
+
+    if (!valid) {
+        munmap(data, st.st_size);
+        memset(file, 0, sizeof(mesh_file_t));
+        return -1;
+    }
+
+    memcpy(mesh->bounds_min, header->bounds_min, sizeof(mesh->bounds_min));
+    memcpy(mesh->bounds_max, header->bounds_max, sizeof(mesh->bounds_max));
+    file->data = data;
+    file->size = st.st_size;
+    return 0;
+}
+
+void mesh_unmap(mesh_file_t* file) {
+    if (file->data) munmap(file->data, file->size);
+    memset(file, 0, sizeof(mesh_file_t));
+}
+
+int mesh_validate(const mesh_t* mesh) {
+    if (mesh->index_count % 3 || (mesh->index_count && !mesh->indices)) return -1;
+    for (int i = 0; i < mesh->index_count; i++) {
+        if ((unsigned)mesh->indices[i] >= (unsigned)mesh->vertex_count) return -1;
+    }
+    return 0;
+}
+
+//===================================================================
+//obj import
+//===================================================================
+
+// bytes read from the file descriptor at a time
+#define OBJ_CHUNK_SIZE (8 << 20)
+// chunks smaller than this are parsed on the calling thread only
+#define OBJ_MIN_SPLIT (64 << 10)
+#define OBJ_MAX_THREADS 64
+
+typedef struct {
+    float* data;
+    int count;
+    int capacity;
+} float_array_t;
+
+typedef struct {
+    int* data;
+    int count;
+    int capacity;
+} int_array_t;
+
+static float* float_array_push(float_array_t* a, int n) {
+    if (a->count + n > a->capacity) {
+        a->capacity = MAX(a->capacity * 2, a->count + n + 256);
+        a->data = (float*)realloc(a->data, a->capacity * sizeof(float));
+    }
+    a->count += n;
+    return a->data + a->count - n;
+}
+
+static int* int_array_push(int_array_t* a, int n) {
+    if (a->count + n > a->capacity) {
+        a->capacity = MAX(a->capacity * 2, a->count + n + 256);
+        a->data = (int*)realloc(a->data, a->capacity * sizeof(int));
+    }
+    a->count += n;
+    return a->data + a->count - n;
+}
+
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static double pow10_int(int e) {
+    double r = 1;
+    int n = e < 0 ? -e : e;
+    while (n > 22) {
+        r *= 1e22;
+        n -= 22;
+    }
+    r *= pow10_table[n];
+    return e < 0 ? 1 / r : r;
+}
+
+// [-]digits[.digits][e[-]digits], up to 19 significant digits are kept which is well past float
+static const char* parse_float(const char* p, const char* end, float* out) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) digits++;
+        }
+        else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digits++;
+                exponent--;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int e = 0, e_negative = 0;
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) e_negative = *p++ == '-';
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (e < 10000) e = e * 10 + (*p - '0');
+        }
+        exponent += e_negative ? -e : e;
+    }
+
+    double value = (double)mantissa * pow10_int(exponent);
+    *out = (float)(negative ? -value : value);
+    return p;
+}
+
+static const char* parse_int(const char* p, const char* end, int* out) {
+    int negative = 0, value = 0;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        value = value * 10 + (*p - '0');
+    }
+    *out = negative ? -value : value;
+    return p;
+}
+
+// relative indices are stored as their index into the slice minus this bias, the slice may not
+// hold the vertex yet so that index can be negative
+#define OBJ_RELATIVE_BIAS (1 << 30)
+
+// everything parsed from one slice of a chunk, face corners are v, vt, vn triples where 0 is
+// missing, positive is a 1 based index into the whole file and anything else relative to this
+// slice, fixed up once the slices before it are known
+typedef struct {
+    const char* begin;
+    const char* end;
+    float_array_t positions;
+    float_array_t texcoords;
+    float_array_t normals;
+    int_array_t corners;
+} obj_slice_t;
+
+static int obj_relative(int index, int count) {
+    return index < 0 ? count + index - OBJ_RELATIVE_BIAS : index;
+}
+
+static void obj_parse_face(obj_slice_t* slice, const char* p, const char* end) {
+    int first[3], previous[3], corner[3], n = 0;
+    int counts[3] = {slice->positions.count / 3, slice->texcoords.count / 2, slice->normals.count / 3};
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p >= end || *p == '#') break;
+
+        corner[0] = corner[1] = corner[2] = 0;
+        for (int k = 0; k < 3; k++) {
+            if (k > 0) {
+                if (p >= end || *p != '/') break;
+                p++;
+            }
+            if (p < end && *p != '/') {
+                p = parse_int(p, end, &corner[k]);
+                corner[k] = obj_relative(corner[k], counts[k]);
+            }
+        }
+        while (p < end && *p != ' ' && *p != '\t') p++;
+        if (!corner[0]) continue;
+
+        // fan around the first corner
+        if (n == 0) {
+            memcpy(first, corner, sizeof(first));
+        }
+        else if (n >= 2) {
+            int* out = int_array_push(&slice->corners, 9);
+            memcpy(out, first, sizeof(first));
+            memcpy(out + 3, previous, sizeof(previous));
+            memcpy(out + 6, corner, sizeof(corner));
+        }
+        memcpy(previous, corner, sizeof(previous));
+        n++;
+    }
+}
+
+static void* obj_parse_slice(void* arg) {
+    obj_slice_t* slice = (obj_slice_t*)arg;
+    const char* p = slice->begin;
+
+    while (p < slice->end) {
+        const char* line = p;
+        const char* end = (const char*)memchr(p, '\n', slice->end - p);
+        end = end ? end : slice->end;
+        p = end + 1;
+
+        while (line < end && (*line == ' ' || *line == '\t')) line++;
+        if (end - line < 2) continue;
+
+        if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+            float* v = float_array_push(&slice->positions, 3);
+            line = parse_float(line + 1, end, &v[0]);
+            line = parse_float(line, end, &v[1]);
+            parse_float(line, end, &v[2]);
+        }
+        else if (line[0] == 'v' && line[1] == 't') {
+            float* t = float_array_push(&slice->texcoords, 2);
+            line = parse_float(line + 2, end, &t[0]);
+            parse_float(line, end, &t[1]);
+        }
+        else if (line[0] == 'v' && line[1] == 'n') {
+            float* n = float_array_push(&slice->normals, 3);
+            line = parse_float(line + 2, end, &n[0]);
+            line = parse_float(line, end, &n[1]);
+            parse_float(line, end, &n[2]);
+        }
+        else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+            obj_parse_face(slice, line + 1, end);
+        }
+    }
+    return NULL;
+}
+
+// the attributes and triangles of the whole file, corners are resolved to 0 based indices
+typedef struct {
+    float_array_t positions;
+    float_array_t texcoords;
+    float_array_t normals;
+    int_array_t corners;
+} obj_data_t;
+
+static void obj_parse_chunk(obj_data_t* obj, const char* text, size_t size, int threads) {
+    obj_slice_t slices[OBJ_MAX_THREADS];
+    pthread_t workers[OBJ_MAX_THREADS];
+    int count = (int)MIN((size_t)threads, size / OBJ_MIN_SPLIT + 1);
+
+    // slices end on line breaks
+    const char* begin = text;
+    for (int i = 0; i < count; i++) {
+        const char* end = text + size * (i + 1) / count;
+        if (i + 1 < count) {
+            const char* lf = end > begin ? (const char*)memchr(end, '\n', text + size - end) : NULL;
+            end = lf ? lf + 1 : text + size;
+        }
+        end = MAX(end, begin);
+        memset(&slices[i], 0, sizeof(obj_slice_t));
+        slices[i].begin = begin;
+        slices[i].end = end;
+        begin = end;
+    }
+
+    int started[OBJ_MAX_THREADS] = {0};
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&workers[i], NULL, obj_parse_slice, &slices[i]) == 0;
+    }
+    obj_parse_slice(&slices[0]);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        }
+        else {
+            obj_parse_slice(&slices[i]);
+        }
+    }
+
+    // append in file order, turning slice relative indices into file indices
+    for (int i = 0; i < count; i++) {
+        obj_slice_t* slice = &slices[i];
+        int bases[3] = {obj->positions.count / 3, obj->texcoords.count / 2, obj->normals.count / 3};
+
+        memcpy(float_array_push(&obj->positions, slice->positions.count), slice->positions.data, slice->positions.count * sizeof(float));
+        memcpy(float_array_push(&obj->texcoords, slice->texcoords.count), slice->texcoords.data, slice->texcoords.count * sizeof(float));
+        memcpy(float_array_push(&obj->normals, slice->normals.count), slice->normals.data, slice->normals.count * sizeof(float));
+
+        int* out = int_array_push(&obj->corners, slice->corners.count);
+        for (int c = 0; c < slice->corners.count; c++) {
+            int index = slice->corners.data[c];
+            out[c] = index > 0 ? index - 1 : index < 0 ? bases[c % 3] + index + OBJ_RELATIVE_BIAS : -1;
+        }
+
+        free(slice->positions.data);
+        free(slice->texcoords.data);
+        free(slice->normals.data);
+        free(slice->corners.data);
+    }
+}
+
+static uint32_t corner_hash(const int* c) {
+    uint32_t h = (uint32_t)c[0] * 73856093u ^ (uint32_t)c[1] * 19349663u ^ (uint32_t)c[2] * 83492791u;
+    return h ^ (h >> 16);
+}
+
+// one vertex per distinct corner, triangles with a corner out of range are dropped
+static void obj_build_mesh(mesh_t* mesh, const obj_data_t* obj) {
+    int counts[3] = {obj->positions.count / 3, obj->texcoords.count / 2, obj->normals.count / 3};
+    int triangles = obj->corners.count / 9;
+
+    int capacity = 1;
+    while (capacity < obj->corners.count / 3 * 2) capacity <<= 1;
+    int* slots = (int*)calloc(capacity, sizeof(int));
+    int* keys = (int*)malloc(obj->corners.count * sizeof(int));
+
+    mesh->indices = (int*)malloc(obj->corners.count / 3 * sizeof(int));
+    int unique = 0, index_count = 0;
+
+    for (int t = 0; t < triangles; t++) {
+        const int* tri = obj->corners.data + t * 9;
+        int valid = 1;
+        for (int k = 0; k < 9; k++) {
+            int attribute = k % 3;
+            if (tri[k] >= counts[attribute] || (attribute == 0 && tri[k] < 0)) valid = 0;
+        }
+        if (!valid) continue;
+
+        for (int j = 0; j < 3; j++) {
+            const int* corner = tri + j * 3;
+            uint32_t slot = corner_hash(corner) & (capacity - 1);
+            while (slots[slot] && memcmp(keys + (slots[slot] - 1) * 3, corner, 3 * sizeof(int))) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            if (!slots[slot]) {
+                memcpy(keys + unique * 3, corner, 3 * sizeof(int));
+                slots[slot] = ++unique;
+            }
+            mesh->indices[index_count++] = slots[slot] - 1;
+        }
+    }
+
+    mesh->vertex_count = unique;
+    mesh->index_count = index_count;
+    mesh->vertices = (float*)malloc(unique * 3 * sizeof(float));
+    if (counts[1]) mesh->texcoords = (float*)malloc(unique * 2 * sizeof(float));
+    if (counts[2]) mesh->normals = (float*)malloc(unique * 3 * sizeof(float));
+
+    for (int v = 0; v < unique; v++) {
+        const int* corner = keys + v * 3;
+        memcpy(mesh->vertices + v * 3, obj->positions.data + corner[0] * 3, 3 * sizeof(float));
+        if (mesh->texcoords) {
+            float* t = mesh->texcoords + v * 2;
+            t[0] = t[1] = 0;
+            if (corner[1] >= 0) memcpy(t, obj->texcoords.data + corner[1] * 2, 2 * sizeof(float));
+        }
+        if (mesh->normals) {
+            float* n = mesh->normals + v * 3;
+            n[0] = n[1] = n[2] = 0;
+            if (corner[2] >= 0) memcpy(n, obj->normals.data + corner[2] * 3, 3 * sizeof(float));
+        }
+    }
+    mesh_update_bounds(mesh);
+
+    free(keys);
+    free(slots);
+}
+
+int mesh_load_obj(mesh_t* mesh, int fd, int threads) {
+    memset(mesh, 0, sizeof(mesh_t));
+    threads = MIN(MAX(threads, 1), OBJ_MAX_THREADS);
+
+    obj_data_t obj;
+    memset(&obj, 0, sizeof(obj));
+
+    size_t capacity = OBJ_CHUNK_SIZE, size = 0;
+    char* buffer = (char*)malloc(capacity);
+    int ok = 1;
+
+    for (;;) {
+        if (size == capacity) {
+            // a single line longer than the chunk
+            capacity *= 2;
+            buffer = (char*)realloc(buffer, capacity);
+        }
+        ssize_t n = read(fd, buffer + size, capacity - size);
+        if (n < 0) {
+            ok = 0;
+            break;
+        }
+        size += n;
+
+        // parse up to the last complete line and keep the rest for the next read
+        size_t parsed = size;
+        if (n > 0) {
+            while (parsed > 0 && buffer[parsed - 1] != '\n') parsed--;
+            if (parsed == 0 && size < capacity) continue;
+        }
+        obj_parse_chunk(&obj, buffer, parsed, threads);
+        memmove(buffer, buffer + parsed, size - parsed);
+        size -= parsed;
+
+        if (n == 0) break;
+    }
+    free(buffer);
+
+    if (ok) {
+        obj_build_mesh(mesh, &obj);
+    }
+
+    free(obj.positions.data);
+    free(obj.texcoords.data);
+    free(obj.normals.data);
+    free(obj.corners.data);
+
+    if (!ok || mesh->index_count == 0) {
+        mesh_destroy(mesh);
+        return -1;
+    }
+    return 0;
+}
+
+//===================================================================
+//cache simulation
+//===================================================================
+
+// FIFO cache over timestamps, a vertex is cached while fewer than cache_size misses happened
+// since it was loaded, returns 1 on a miss
+static int cache_touch(unsigned* stamps, unsigned* time, int v, int cache_size) {
+    if (*time - stamps[v] > (unsigned)cache_size) {
+        stamps[v] = (*time)++;
+        return 1;
+    }
+    return 0;
+}
+
+// start from an empty cache without clearing the stamps
+static void cache_reset(unsigned* time, int cache_size) {
+    *time += cache_size + 1;
+}
+
+float mesh_acmr(const int* indices, int count, int vertex_count, int cache_size) {
+    int triangles = count / 3;
+    if (triangles == 0) return 0;
+
+    unsigned* stamps = (unsigned*)calloc(vertex_count, sizeof(unsigned));
+    unsigned time = 0;
+    cache_reset(&time, cache_size);
+
+    int misses = 0;
+    for (int i = 0; i < triangles * 3; i++) {
+        misses += cache_touch(stamps, &time, indices[i], cache_size);
+    }
+
+    free(stamps);
+    return (float)misses / triangles;
+}
+
+//===================================================================
+//tipsify
+//===================================================================
+
+// triangles around every vertex: the ones of vertex v are triangles[offsets[v] .. offsets[v + 1] - 1]
+typedef struct {
+    int* offsets;
+    int* triangles;
+} adjacency_t;
+
+static void adjacency_init(adjacency_t* adj, const int* indices, int triangles, int vertex_count) {
+    adj->offsets = (int*)calloc(vertex_count + 1, sizeof(int));
+    adj->triangles = (int*)malloc(triangles * 3 * sizeof(int));
+
+    for (int i = 0; i < triangles * 3; i++) {
+        adj->offsets[indices[i] + 1]++;
+    }
+    for (int v = 0; v < vertex_count; v++) {
+        adj->offsets[v + 1] += adj->offsets[v];
+    }
+
+    int* fill = (int*)malloc(vertex_count * sizeof(int));
+    memcpy(fill, adj->offsets, vertex_count * sizeof(int));
+    for (int i = 0; i < triangles * 3; i++) {
+        adj->triangles[fill[indices[i]]++] = i / 3;
+    }
+    free(fill);
+}
+
+static void adjacency_destroy(adjacency_t* adj) {
+    free(adj->offsets);
+    free(adj->triangles);
+}
+
+typedef struct {
+    const int* indices;
+    adjacency_t adj;
+    int* live;          // triangles not emitted yet around each vertex
+    unsigned* stamps;   // cache time of each vertex
+    unsigned time;
+    int* dead_end;      // recently touched vertices, to restart from when a fan runs dry
+    int dead_count;
+    int cursor;         // next vertex in input order to try when the stack is empty
+    int vertex_count;
+    int cache_size;
+} tipsify_t;
+
+// the next vertex when the stack is empty or holds only finished vertices, -1 when done
+static int tipsify_skip_dead_end(tipsify_t* t) {
+    while (t->dead_count > 0) {
+        int v = t->dead_end[--t->dead_count];
+        if (t->live[v] > 0) return v;
+    }
+    for (; t->cursor < t->vertex_count; t->cursor++) {
+        if (t->live[t->cursor] > 0) return t->cursor;
+    }
+    return -1;
+}
+
+// pick among the vertices just emitted the one whose remaining triangles would still find it in
+// the cache, the oldest such vertex first, *jumped is set when the choice comes from the stack
+static int tipsify_next(tipsify_t* t, const int* candidates, int count, int* jumped) {
+    // as in the paper the best priority starts at -1, so a live neighbour that left the cache
+    // still beats a jump, the stack is only used once no candidate has triangles left
+    int best = -1, priority = -1;
+    for (int i = 0; i < count; i++) {
+        int v = candidates[i];
+        if (t->live[v] <= 0) continue;
+
+        int p = 0;
+        int age = (int)(t->time - t->stamps[v]);
+        if (age + 2 * t->live[v] <= t->cache_size) {
+            p = age;
+        }
+        if (p > priority) {
+            priority = p;
+            best = v;
+        }
+    }
+
+    *jumped = best < 0;
+    return best < 0 ? tipsify_skip_dead_end(t) : best;
+}
+
+// Sander et al., Fast Triangle Reordering for Vertex Locality and Reduced Overdraw. out gets the
+// new triangle order and clusters the first triangle of every run that started from a dead end,
+// returns the number of clusters
+static int tipsify(const int* indices, int triangles, int vertex_count, int cache_size, int* out, int* clusters) {
+    tipsify_t t;
+    t.indices = indices;
+    t.vertex_count = vertex_count;
+    t.cache_size = cache_size;
+    adjacency_init(&t.adj, indices, triangles, vertex_count);
+    t.live = (int*)malloc(vertex_count * sizeof(int));
+    for (int v = 0; v < vertex_count; v++) {
+        t.live[v] = t.adj.offsets[v + 1] - t.adj.offsets[v];
+    }
+    t.stamps = (unsigned*)calloc(vertex_count, sizeof(unsigned));
+    t.time = cache_size + 1;
+    t.dead_end = (int*)malloc(triangles * 3 * sizeof(int));
+    t.dead_count = 0;
+    t.cursor = 0;
+
+    uint8_t* emitted = (uint8_t*)calloc(triangles, 1);
+    int* candidates = (int*)malloc(triangles * 3 * sizeof(int));
+    int emitted_count = 0, cluster_count = 0;
+    int jumped = 1;
+
+    int fan = tipsify_skip_dead_end(&t);
+    while (fan >= 0) {
+        if (jumped) {
+            clusters[cluster_count++] = emitted_count;
+        }
+
+        int candidate_count = 0;
+        for (int k = t.adj.offsets[fan]; k < t.adj.offsets[fan + 1]; k++) {
+            int tri = t.adj.triangles[k];
+            if (emitted[tri]) continue;
+
+            for (int j = 0; j < 3; j++) {
+                int v = indices[tri * 3 + j];
+                t.dead_end[t.dead_count++] = v;
+                candidates[candidate_count++] = v;
+                t.live[v]--;
+                if (t.time - t.stamps[v] > (unsigned)cache_size) {
+                    t.stamps[v] = t.time++;
+                }
+            }
+            emitted[tri] = 1;
+            out[emitted_count++] = tri;
+        }
+
+        fan = tipsify_next(&t, candidates, candidate_count, &jumped);
+    }
+
+    // a cluster that began on a fan with nothing left to emit is empty
+    int n = 0;
+    for (int i = 0; i < cluster_count; i++) {
+        if (clusters[i] < emitted_count && (n == 0 || clusters[n - 1] != clusters[i])) {
+            clusters[n++] = clusters[i];
+        }
+    }
+
+    free(emitted);
+    free(candidates);
+    free(t.dead_end);
+    free(t.stamps);
+    free(t.live);
+    adjacency_destroy(&t.adj);
+    return n;
+}
+
+//===================================================================
+//overdraw
+//===================================================================
+
+// split the hard clusters of tipsify where the running ACMR is already as good as the whole
+// cluster, smaller clusters sort better and cost little vertex reuse
+static int split_clusters(const int* indices, int triangles, int vertex_count, int cache_size,
+                          const int* hard, int hard_count, int* soft) {
+    unsigned* stamps = (unsigned*)calloc(vertex_count, sizeof(unsigned));
+    unsigned time = 0;
+    int n = 0;
+
+    for (int c = 0; c < hard_count; c++) {
+        int start = hard[c];
+        int end = c + 1 < hard_count ? hard[c + 1] : triangles;
+
+        int misses = 0;
+        cache_reset(&time, cache_size);
+        for (int i = start * 3; i < end * 3; i++) {
+            misses += cache_touch(stamps, &time, indices[i], cache_size);
+        }
+        float threshold = MESH_OVERDRAW_THRESHOLD * misses / (end - start);
+
+        soft[n++] = start;
+        int running_misses = 0, running_triangles = 0;
+        cache_reset(&time, cache_size);
+        for (int i = start; i < end; i++) {
+            for (int j = 0; j < 3; j++) {
+                running_misses += cache_touch(stamps, &time, indices[i * 3 + j], cache_size);
+            }
+            running_triangles++;
+
+            if (i + 1 < end && (float)running_misses / running_triangles <= threshold) {
+                soft[n++] = i + 1;
+                running_misses = running_triangles = 0;
+                cache_reset(&time, cache_size);
+            }
+        }
+    }
+
+    free(stamps);
+    return n;
+}
+
+typedef struct {
+    float key;
+    int start, end;
+} cluster_t;
+
+static int cluster_compare(const void* a, const void* b) {
+    const cluster_t* ca = (const cluster_t*)a;
+    const cluster_t* cb = (const cluster_t*)b;
+    if (ca->key != cb->key) return ca->key > cb->key ? -1 : 1;
+    return ca->start - cb->start;
+}
+
+// occlusion potential of every cluster: how far its area weighted centroid lies out along its
+// average normal from the centroid of the mesh, clusters that face outwards come first
+static void sort_clusters(int* indices, int triangles, const float* vertices, const int* starts, int count) {
+    cluster_t* clusters = (cluster_t*)malloc(count * sizeof(cluster_t));
+    float* centroids = (float*)calloc(count * 3, sizeof(float));
+    float* normals = (float*)calloc(count * 3, sizeof(float));
+    float* areas = (float*)calloc(count, sizeof(float));
+    float mesh[3] = {0, 0, 0}, mesh_area = 0;
+
+    for (int c = 0; c < count; c++) {
+        clusters[c].start = starts[c];
+        clusters[c].end = c + 1 < count ? starts[c + 1] : triangles;
+
+        for (int i = clusters[c].start; i < clusters[c].end; i++) {
+            const float* a = vertices + indices[i * 3] * 3;
+            const float* b = vertices + indices[i * 3 + 1] * 3;
+            const float* d = vertices + indices[i * 3 + 2] * 3;
+            float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+            float e2[3] = {d[0] - a[0], d[1] - a[1], d[2] - a[2]};
+            float n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+            float area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+            for (int k = 0; k < 3; k++) {
+                float center = (a[k] + b[k] + d[k]) / 3;
+                centroids[c * 3 + k] += center * area;
+                normals[c * 3 + k] += n[k];
+            }
+            areas[c] += area;
+        }
+
+        for (int k = 0; k < 3; k++) {
+            mesh[k] += centroids[c * 3 + k];
+        }
+        mesh_area += areas[c];
+    }
+
+    for (int k = 0; k < 3; k++) {
+        mesh[k] = mesh_area > 0 ? mesh[k] / mesh_area : 0;
+    }
+
+    for (int c = 0; c < count; c++) {
+        float* centroid = centroids + c * 3;
+        float* n = normals + c * 3;
+        float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        float key = 0;
+        if (areas[c] > 0 && len > 0) {
+            for (int k = 0; k < 3; k++) {
+                key += (centroid[k] / areas[c] - mesh[k]) * n[k] / len;
+            }
+        }
+        clusters[c].key = key;
+    }
+
+    qsort(clusters, count, sizeof(cluster_t), cluster_compare);
+
+    int* sorted = (int*)malloc(triangles * 3 * sizeof(int));
+    int n = 0;
+    for (int c = 0; c < count; c++) {
+        int size = (clusters[c].end - clusters[c].start) * 3;
+        memcpy(sorted + n, indices + clusters[c].start * 3, size * sizeof(int));
+        n += size;
+    }
+    memcpy(indices, sorted, triangles * 3 * sizeof(int));
+
+    free(sorted);
+    free(areas);
+    free(normals);
+    free(centroids);
+    free(clusters);
+}
+
+void mesh_optimize(int* indices, int count, const float* vertices, int vertex_count, int cache_size,
+                   float* acmr_before, float* acmr_after) {
+    int triangles = count / 3;
+    if (cache_size <= 0) cache_size = MESH_CACHE_SIZE;
+    if (acmr_before) *acmr_before = mesh_acmr(indices, count, vertex_count, cache_size);
+
+    if (triangles > 0) {
+        int* order = (int*)malloc(triangles * sizeof(int));
+        int* hard = (int*)malloc(triangles * sizeof(int));
+        int hard_count = tipsify(indices, triangles, vertex_count, cache_size, order, hard);
+
+        int* reordered = (int*)malloc(triangles * 3 * sizeof(int));
+        for (int i = 0; i < triangles; i++) {
+            memcpy(reordered + i * 3, indices + order[i] * 3, 3 * sizeof(int));
+        }
+        memcpy(indices, reordered, triangles * 3 * sizeof(int));
+        free(reordered);
+
+        if (vertices) {
+            int* soft = (int*)malloc(triangles * sizeof(int));
+            int soft_count = split_clusters(indices, triangles, vertex_count, cache_size, hard, hard_count, soft);
+            sort_clusters(indices, triangles, vertices, soft, soft_count);
+            free(soft);
+        }
+
+        free(hard);
+        free(order);
+    }
+
+    if (acmr_after) *acmr_after = mesh_acmr(indices, count, vertex_count, cache_size);
+}
+
+//===================================================================
+//level of detail
+//===================================================================
+
+// collapses with a triangle normal turning by more than this are rejected, cosine of the angle
+#define LOD_FLIP_COS 0.2f
+
+// sum of squared distances to planes, a0..a5 the symmetric A, b the linear and c the constant
+// terms of the plane equations, w the weight so evaluations give a mean over the planes
+typedef struct {
+    double a[6];
+    double b[3];
+    double c;
+    double w;
+} quadric_t;
+
+static void quadric_add_plane(quadric_t* q, const double* n, double d, double w) {
+    q->a[0] += w * n[0] * n[0];
+    q->a[1] += w * n[0] * n[1];
+    q->a[2] += w * n[0] * n[2];
+    q->a[3] += w * n[1] * n[1];
+    q->a[4] += w * n[1] * n[2];
+    q->a[5] += w * n[2] * n[2];
+    for (int k = 0; k < 3; k++) q->b[k] += w * n[k] * d;
+    q->c += w * d * d;
+    q->w += w;
+}
+
+static void quadric_add(quadric_t* q, const quadric_t* o) {
+    for (int k = 0; k < 6; k++) q->a[k] += o->a[k];
+    for (int k = 0; k < 3; k++) q->b[k] += o->b[k];
+    q->c += o->c;
+    q->w += o->w;
+}
+
+// mean squared distance of p to the planes of q and r together
+static double quadric_error(const quadric_t* q, const quadric_t* r, const float* p) {
+    double x = p[0], y = p[1], z = p[2];
+    double a[6], b[3];
+    for (int k = 0; k < 6; k++) a[k] = q->a[k] + r->a[k];
+    for (int k = 0; k < 3; k++) b[k] = q->b[k] + r->b[k];
+    double w = q->w + r->w;
+    double e = a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z
+             + a[3] * y * y + 2 * a[4] * y * z + a[5] * z * z
+             + 2 * (b[0] * x + b[1] * y + b[2] * z) + q->c + r->c;
+    return w > 0 ? fabs(e) / w : 0;
+}
+
+static void triangle_cross(const float* p0, const float* p1, const float* p2, double* n) {
+    double e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+    double e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// planes of the triangles weighted by area
+static void lod_quadrics(quadric_t* quadrics, const int* indices, int triangles, const float* vertices) {
+    for (int t = 0; t < triangles; t++) {
+        const int* tri = indices + t * 3;
+        const float* p0 = vertices + tri[0] * 3;
+        double n[3];
+        triangle_cross(p0, vertices + tri[1] * 3, vertices + tri[2] * 3, n);
+        double len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (len == 0) continue;
+        for (int k = 0; k < 3; k++) n[k] /= len;
+        double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+        for (int k = 0; k < 3; k++) {
+            quadric_add_plane(&quadrics[tri[k]], n, d, len * 0.5);
+        }
+    }
+}
+
+// vertices on an edge without a twin going the other way, which are the borders of the surface
+// and the attribute seams where the welded mesh has split it
+static void lod_locked(uint8_t* locked, const int* indices, int triangles, const adjacency_t* adj, int vertex_count) {
+    memset(locked, 0, vertex_count);
+    for (int i = 0; i < triangles * 3; i++) {
+        int a = indices[i];
+        int b = indices[i - i % 3 + (i + 1) % 3];
+        int twin = 0;
+        for (int j = adj->offsets[b]; j < adj->offsets[b + 1] && !twin; j++) {
+            const int* tri = indices + adj->triangles[j] * 3;
+            for (int k = 0; k < 3; k++) {
+                if (tri[k] == b && tri[(k + 1) % 3] == a) twin = 1;
+            }
+        }
+        if (!twin) locked[a] = locked[b] = 1;
+    }
+}
+
+typedef struct {
+    int from, to;
+    float error;
+} collapse_t;
+
+static int collapse_compare(const void* a, const void* b) {
+    float ea = ((const collapse_t*)a)->error, eb = ((const collapse_t*)b)->error;
+    return ea < eb ? -1 : ea > eb;
+}
+
+// moving from onto to must not fold over any triangle that survives around from
+static int lod_collapse_flips(const int* indices, const adjacency_t* adj, const int* remap,
+                              const float* vertices, int from, int to) {
+    const float* target = vertices + to * 3;
+    for (int j = adj->offsets[from]; j < adj->offsets[from + 1]; j++) {
+        const int* tri = indices + adj->triangles[j] * 3;
+        int v[3] = {remap[tri[0]], remap[tri[1]], remap[tri[2]]};
+        if (v[0] == to || v[1] == to || v[2] == to) continue;
+        if (v[0] == v[1] || v[1] == v[2] || v[2] == v[0]) continue;
+        
+        const float* p[3];
+        for (int k = 0; k < 3; k++) p[k] = vertices + v[k] * 3;
+        double before[3], after[3];
+        triangle_cross(p[0], p[1], p[2], before);
+        for (int k = 0; k < 3; k++) if (v[k] == from) p[k] = target;
+        triangle_cross(p[0], p[1], p[2], after);
+        
+        double dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+        double lb = sqrt(before[0] * before[0] + before[1] * before[1] + before[2] * before[2]);
+        double la = sqrt(after[0] * after[0] + after[1] * after[1] + after[2] * after[2]);
+        if (dot <= LOD_FLIP_COS * lb * la) return 1;
+    }
+    return 0;
+}
+
+// collapse edges of indices in passes until at most target triangles remain, every vertex moves
+// or receives at most once per pass so the flip tests see a consistent neighbourhood. returns
+// the new index count and raises *error to the largest collapse error taken
+static int lod_simplify(int* indices, int count, const float* vertices, int vertex_count,
+                        quadric_t* quadrics, int target, float* error) {
+    int triangles = count / 3;
+    uint8_t* locked = (uint8_t*)malloc(vertex_count);
+    uint8_t* touched = (uint8_t*)malloc(vertex_count);
+    int* remap = (int*)malloc(vertex_count * sizeof(int));
+    collapse_t* collapses = (collapse_t*)malloc(triangles * 3 * sizeof(collapse_t));
+    
+    while (triangles > target) {
+        adjacency_t adj;
+        adjacency_init(&adj, indices, triangles, vertex_count);
+        lod_locked(locked, indices, triangles, &adj, vertex_count);
+        
+        int n = 0;
+        for (int i = 0; i < triangles * 3; i++) {
+            int a = indices[i];
+            int b = indices[i - i % 3 + (i + 1) % 3];
+            if (locked[a]) continue;
+            collapses[n].from = a;
+            collapses[n].to = b;
+            collapses[n].error = (float)quadric_error(&quadrics[a], &quadrics[b], vertices + b * 3);
+            n++;
+        }
+        qsort(collapses, n, sizeof(collapse_t), collapse_compare);
+        
+        for (int v = 0; v < vertex_count; v++) remap[v] = v;
+        memset(touched, 0, vertex_count);
+        
+        // an interior collapse removes the two triangles on its edge
+        int removed = 0;
+        for (int c = 0; c < n && triangles - removed > target; c++) {
+            int a = collapses[c].from, b = collapses[c].to;
+            if (touched[a] || touched[b]) continue;
+            if (lod_collapse_flips(indices, &adj, remap, vertices, a, b)) continue;
+            
+            remap[a] = b;
+            touched[a] = touched[b] = 1;
+            quadric_add(&quadrics[b], &quadrics[a]);
+            if (collapses[c].error > *error) *error = collapses[c].error;
+            removed += 2;
+        }
+        adjacency_destroy(&adj);
+        if (removed == 0) break;
+        
+        int kept = 0;
+        for (int t = 0; t < triangles; t++) {
+            int v0 = remap[indices[t * 3]], v1 = remap[indices[t * 3 + 1]], v2 = remap[indices[t * 3 + 2]];
+            if (v0 == v1 || v1 == v2 || v2 == v0) continue;
+            indices[kept * 3] = v0;
+            indices[kept * 3 + 1] = v1;
+            indices[kept * 3 + 2] = v2;
+            kept++;
+        }
+        triangles = kept;
+    }
+    
+    free(collapses);
+    free(remap);
+    free(touched);
+    free(locked);
+    return triangles * 3;
+}
+
+int mesh_build_lod(mesh_lod_t* lod, const mesh_t* mesh, int levels, float ratio) {
+    memset(lod, 0, sizeof(mesh_lod_t));
+    if (levels > MESH_LOD_MAX) levels = MESH_LOD_MAX;
+    if (levels <= 0 || !mesh->indices) return 0;
+    
+    int count = mesh->index_count - mesh->index_count % 3;
+    lod->indices[0] = (int*)malloc(count * sizeof(int));
+    memcpy(lod->indices[0], mesh->indices, count * sizeof(int));
+    lod->index_count[0] = count;
+    lod->count = 1;
+    
+    quadric_t* quadrics = (quadric_t*)calloc(mesh->vertex_count, sizeof(quadric_t));
+    lod_quadrics(quadrics, mesh->indices, count / 3, mesh->vertices);
+    
+    // each level goes on from the one before with the quadrics its collapses have merged
+    int* work = (int*)malloc(count * sizeof(int));
+    memcpy(work, mesh->indices, count * sizeof(int));
+    float error = 0;
+    while (lod->count < levels) {
+        int target = (int)(count / 3 * ratio);
+        int simplified = lod_simplify(work, count, mesh->vertices, mesh->vertex_count, quadrics, target, &error);
+        if (simplified == count) break;
+        count = simplified;
+        
+        int level = lod->count++;
+        lod->indices[level] = (int*)malloc(count * sizeof(int));
+        memcpy(lod->indices[level], work, count * sizeof(int));
+        lod->index_count[level] = count;
+        lod->error[level] = sqrtf(error);
+    }
+    
+    free(work);
+    free(quadrics);
+    return lod->count;
+}
+
+void mesh_lod_destroy(mesh_lod_t* lod) {
+    for (int i = 0; i < lod->count; i++) {
+        free(lod->indices[i]);
+    }
+    memset(lod, 0, sizeof(mesh_lod_t));
+}
+
+int mesh_lod_select(const device_t* device, const mesh_t* mesh, const mesh_lod_t* lod, float pixel_error) {
+    const transform_t* transform = &device->transform;
+    float center[4], model[4], eye[4];
+    for (int k = 0; k < 3; k++) {
+        center[k] = (mesh->bounds_min[k] + mesh->bounds_max[k]) * 0.5f;
+    }
+    center[3] = 1;
+    mat4_apply(model, transform->model, center);
+    mat4_apply(eye, transform->view, model);
+    
+    // largest stretch of the model matrix, errors and the radius grow with it
+    const float* m = transform->model;
+    float scale = 0, radius = 0;
+    for (int k = 0; k < 3; k++) {
+        float s = m[k * 4] * m[k * 4] + m[k * 4 + 1] * m[k * 4 + 1] + m[k * 4 + 2] * m[k * 4 + 2];
+        float e = (mesh->bounds_max[k] - mesh->bounds_min[k]) * 0.5f;
+        scale = MAX(scale, s);
+        radius += e * e;
+    }
+    scale = sqrtf(scale);
+    radius = sqrtf(radius) * scale;
+    
+    // the camera looks down -z, a sphere reaching past the eye gets full detail
+    float distance = -eye[2] - radius;
+    if (distance <= 0) return 0;
+    
+    // pixels per object space unit at that distance, from the vertical focal length
+    float pixels = transform->projection[5] * device->height * 0.5f * scale / distance;
+    int level = 0;
+    for (int i = 1; i < lod->count; i++) {
+        if (lod->error[i] * pixels > pixel_error) break;
+        level = i;
+    }
+    return level;
+}
+
+void mesh_draw_lod(device_t* device, const mesh_t* mesh, const mesh_lod_t* lod, float pixel_error) {
+    int level = mesh_lod_select(device, mesh, lod, pixel_error);
+    mesh_bind(device, mesh);
+    draw_elements(device, lod->indices[level], lod->index_count[level]);
+}
@@ -0,0 +1,166 @@
+//
+//  mesh.h
+//  SoftwareRender
+//
+//  Created by xiaov.
+//
+
+#ifndef mesh_h
+#define mesh_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "renderer.h"
+
+//===================================================================
+//indexed mesh
+//===================================================================
+
+// one entry per distinct vertex, attribute arrays the source did not have are NULL
+typedef struct {
+    int vertex_count;
+    float bounds_min[3];
+    float bounds_max[3];
+    float* vertices;    // xyz
+    float* normals;     // xyz
+    float* texcoords;   // uv
+    float* colors;      // rgba
+    int index_count;
+    int* indices;       // three per triangle, for draw_elements
+} mesh_t;
+
+// weld the draw_arrays style arrays of count vertices into mesh, vertices whose position,
+// normal, texcoord and color are all bit for bit equal become one, returns mesh->vertex_count
+int mesh_weld(mesh_t* mesh, int count, const float* vertices, const float* normals, const float* texcoords, const float* colors);
+void mesh_destroy(mesh_t* mesh);
+
+// point the device arrays and bounds at the mesh, then draw_elements(device, mesh->indices, mesh->index_count)
+void mesh_bind(device_t* device, const mesh_t* mesh);
+
+//===================================================================
+//quantized mesh
+//===================================================================
+
+// a mesh_t in the quantized vertex formats of the device, 14 bytes per vertex instead of 32
+// for position, normal and texcoord, arrays the source did not have are NULL
+typedef struct {
+    int vertex_count;
+    float bounds_min[3];
+    float bounds_max[3];
+    uint16_t* vertices;     // xyz over the bounds
+    uint32_t* normals;      // octahedral
+    uint16_t* texcoords;    // uv over texcoord_min .. texcoord_max
+    float texcoord_min[2];
+    float texcoord_max[2];
+    float* colors;          // rgba, kept as floats
+    int index_count;
+    int* indices;
+} mesh_quantized_t;
+
+void mesh_quantize(mesh_quantized_t* out, const mesh_t* mesh);
+void mesh_quantized_destroy(mesh_quantized_t* mesh);
+void mesh_quantized_bind(device_t* device, const mesh_quantized_t* mesh);
+
+//===================================================================
+//binary mesh file
+//===================================================================
+
+// little endian, a header followed by the streams, each starting on a MESH_FILE_ALIGN boundary
+#define MESH_FILE_MAGIC 0x4853454d  // "MESH"
+#define MESH_FILE_VERSION 1
+#define MESH_FILE_ALIGN 16
+
+#define MESH_STREAM_POSITION 0      // float xyz
+#define MESH_STREAM_NORMAL 1        // float xyz
+#define MESH_STREAM_TEXCOORD 2      // float uv
+#define MESH_STREAM_COLOR 3         // float rgba
+#define MESH_STREAM_INDEX 4         // int32, three per triangle
+#define MESH_STREAM_COUNT 5
+
+typedef struct {
+    uint32_t offset;    // from the start of the file, 0 when the stream is absent
+    uint32_t size;      // in bytes
+} mesh_stream_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t index_count;
+    float bounds_min[3];
+    float bounds_max[3];
+    mesh_stream_t streams[MESH_STREAM_COUNT];
+} mesh_file_header_t;
+
+// a mesh file mapped read only, mesh points into the mapping and is released by mesh_unmap
+typedef struct {
+    mesh_t mesh;
+    void* data;
+    size_t size;
+} mesh_file_t;
+
+// returns 0 on success
+int mesh_save(const mesh_t* mesh, const char* path);
+// returns 0 on success, -1 when the file can not be mapped or is not a valid mesh file
+int mesh_map(mesh_file_t* file, const char* path);
+void mesh_unmap(mesh_file_t* file);
+// returns 0 when every index names a vertex of the mesh. mesh_map only checks the header and the
+// stream sizes so indices are paged in when drawn, draw_elements skips triangles with bad indices
+int mesh_validate(const mesh_t* mesh);
+
+//===================================================================
+//obj import
+//===================================================================
+
+// read a Wavefront OBJ from fd up to end of file into an indexed mesh: polygons become fans and
+// corners with the same v/vt/vn share a vertex. the text is streamed in chunks whose lines are
+// parsed by threads workers, so the file never has to fit in memory. returns 0 on success
+int mesh_load_obj(mesh_t* mesh, int fd, int threads);
+
+//===================================================================
+//index buffer optimization
+//===================================================================
+
+// FIFO cache size mesh_optimize tunes for when none is given
+#define MESH_CACHE_SIZE 16
+
+// average cache miss ratio, vertices transformed per triangle through a FIFO post transform
+// cache of cache_size entries, 0.5 is the best a regular mesh can reach and 3 the worst
+float mesh_acmr(const int* indices, int count, int vertex_count, int cache_size);
+
+// reorder the triangles of an index buffer in place, count indices and three per triangle:
+// Tipsify for post transform cache reuse, then its clusters are sorted so the ones facing
+// outwards come first and hide the rest behind them. vertices holds xyz per vertex like the
+// vertex pointer, triangles are counter clockwise. acmr_before and acmr_after may be NULL
+void mesh_optimize(int* indices, int count, const float* vertices, int vertex_count, int cache_size,
+                   float* acmr_before, float* acmr_after);
+
+//===================================================================
+//level of detail
+//===================================================================
+
+#define MESH_LOD_MAX 8
+
+// index buffers of decreasing detail over the vertices of one mesh, level 0 is the mesh itself.
+// error is how far each level may stray from the surface of level 0, in object space units
+typedef struct {
+    int count;
+    int index_count[MESH_LOD_MAX];
+    int* indices[MESH_LOD_MAX];
+    float error[MESH_LOD_MAX];
+} mesh_lod_t;
+
+// simplify mesh by quadric error edge collapses into up to levels levels, each keeping about
+// ratio of the triangles of the one before. vertices only ever collapse onto other vertices, so
+// every level draws with the vertex arrays of mesh. borders and attribute seams are kept in
+// place. returns lod->count, which is lower than levels once no collapse is left
+int mesh_build_lod(mesh_lod_t* lod, const mesh_t* mesh, int levels, float ratio);
+void mesh_lod_destroy(mesh_lod_t* lod);
+
+// the coarsest level whose error covers at most pixel_error pixels on screen with the current
+// model, view and projection of the device, judged at the nearest point of the mesh bounds
+int mesh_lod_select(const device_t* device, const mesh_t* mesh, const mesh_lod_t* lod, float pixel_error);
+// mesh_bind and draw_elements with the level mesh_lod_select picks
+void mesh_draw_lod(device_t* device, const mesh_t* mesh, const mesh_lod_t* lod, float pixel_error);
+
+#endif /* mesh_h */
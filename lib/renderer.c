@@ -9,6 +9,15 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+// the SSE4.2 and AVX2 kernels are built whatever the compiler flags, device_simd picks one at run time
+#define DEVICE_DISPATCH
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
 typedef enum {
     false, true
@@ -23,6 +32,9 @@ typedef enum {
 #define CEIL(x) ((int)(x))
 #define ROUND(x) ((int)(x + 0.5))
 
+// half-space block and hierarchical z block edge, divides DEVICE_TILE_SIZE
+#define BLOCK_SIZE 8
+
 // t -> [0, 1]
 float interp(float x1, float x2, float t) {
     return x1 + (x2 - x1) * t;
@@ -157,8 +169,51 @@ void mat4_invert(float * out, const float* a) {
     out[15] = (a20 * b03 - a21 * b01 + a22 * b00) * det;
 }
 
+// the matrix products below add the four terms of every element in the same order in all
+// paths, so SSE, AVX and scalar builds give the same bits
+#if defined(__AVX__)
+// x in the low and y in the high four lanes
+static inline __m256 splat2(float x, float y) {
+    return _mm256_insertf128_ps(_mm256_set1_ps(x), _mm_set1_ps(y), 1);
+}
+
+// column k of m in both halves
+static inline __m256 column2(const float* m, int k) {
+    __m128 c = _mm_loadu_ps(m + k * 4);
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(c), c, 1);
+}
+
+// out = a * b two columns at a time, b is read before each store so out may be a or b
+static inline void mat4_multiply_avx(float* out, const __m256* a, const float* b) {
+    for (int j = 0; j < 16; j += 8) {
+        __m256 c = _mm256_mul_ps(a[0], splat2(b[j], b[j + 4]));
+        c = _mm256_add_ps(c, _mm256_mul_ps(a[1], splat2(b[j + 1], b[j + 5])));
+        c = _mm256_add_ps(c, _mm256_mul_ps(a[2], splat2(b[j + 2], b[j + 6])));
+        c = _mm256_add_ps(c, _mm256_mul_ps(a[3], splat2(b[j + 3], b[j + 7])));
+        _mm256_storeu_ps(out + j, c);
+    }
+}
+#elif defined(__SSE2__)
+static inline void mat4_multiply_sse(float* out, const __m128* a, const float* b) {
+    for (int j = 0; j < 16; j += 4) {
+        __m128 c = _mm_mul_ps(a[0], _mm_set1_ps(b[j]));
+        c = _mm_add_ps(c, _mm_mul_ps(a[1], _mm_set1_ps(b[j + 1])));
+        c = _mm_add_ps(c, _mm_mul_ps(a[2], _mm_set1_ps(b[j + 2])));
+        c = _mm_add_ps(c, _mm_mul_ps(a[3], _mm_set1_ps(b[j + 3])));
+        _mm_storeu_ps(out + j, c);
+    }
+}
+#endif
+
 // multiply
 void mat4_multiply(float* out, const float* a, const float* b) {
+#if defined(__AVX__)
+    __m256 columns[4] = {column2(a, 0), column2(a, 1), column2(a, 2), column2(a, 3)};
+    mat4_multiply_avx(out, columns, b);
+#elif defined(__SSE2__)
+    __m128 columns[4] = {_mm_loadu_ps(a), _mm_loadu_ps(a + 4), _mm_loadu_ps(a + 8), _mm_loadu_ps(a + 12)};
+    mat4_multiply_sse(out, columns, b);
+#else
     float a00 = a[0],  a01 = a[1],  a02 = a[2],  a03 = a[3],
           a10 = a[4],  a11 = a[5],  a12 = a[6],  a13 = a[7],
           a20 = a[8],  a21 = a[9],  a22 = a[10], a23 = a[11],
@@ -187,6 +242,26 @@ void mat4_multiply(float* out, const float* a, const float* b) {
     out[13] = b0*a01 + b1*a11 + b2*a21 + b3*a31;
     out[14] = b0*a02 + b1*a12 + b2*a22 + b3*a32;
     out[15] = b0*a03 + b1*a13 + b2*a23 + b3*a33;
+#endif
+}
+
+// out[i] = a * b[i], the columns of a are loaded once
+void mat4_multiply_batch(float* out, const float* a, const float* b, int count) {
+#if defined(__AVX__)
+    __m256 columns[4] = {column2(a, 0), column2(a, 1), column2(a, 2), column2(a, 3)};
+    for (int i = 0; i < count; i++) {
+        mat4_multiply_avx(out + i * 16, columns, b + i * 16);
+    }
+#elif defined(__SSE2__)
+    __m128 columns[4] = {_mm_loadu_ps(a), _mm_loadu_ps(a + 4), _mm_loadu_ps(a + 8), _mm_loadu_ps(a + 12)};
+    for (int i = 0; i < count; i++) {
+        mat4_multiply_sse(out + i * 16, columns, b + i * 16);
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        mat4_multiply(out + i * 16, a, b + i * 16);
+    }
+#endif
 }
 
 // translate
@@ -293,11 +368,38 @@ void mat4_rotate(float* out, const float* a, float rad, const float* axis) {
 
 // apply
 void mat4_apply(float* out, const float* m, const float* v) {
+#if defined(__SSE2__)
+    __m128 r = _mm_mul_ps(_mm_set1_ps(v[0]), _mm_loadu_ps(m));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v[1]), _mm_loadu_ps(m + 4)));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v[2]), _mm_loadu_ps(m + 8)));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v[3]), _mm_loadu_ps(m + 12)));
+    _mm_storeu_ps(out, r);
+#else
     float x = v[0], y = v[1], z = v[2], w = v[3];
     out[0] = x * m[0] + y * m[4] + z * m[8]  + w * m[12];
     out[1] = x * m[1] + y * m[5] + z * m[9]  + w * m[13];
     out[2] = x * m[2] + y * m[6] + z * m[10] + w * m[14];
     out[3] = x * m[3] + y * m[7] + z * m[11] + w * m[15];
+#endif
+}
+
+// out[i] = m * v[i] for count vec4s, out may be v
+void mat4_apply_batch(float* out, const float* m, const float* v, int count) {
+    int i = 0;
+#if defined(__AVX__)
+    __m256 c0 = column2(m, 0), c1 = column2(m, 1), c2 = column2(m, 2), c3 = column2(m, 3);
+    for (; i + 2 <= count; i += 2) {
+        const float* p = v + i * 4;
+        __m256 r = _mm256_mul_ps(splat2(p[0], p[4]), c0);
+        r = _mm256_add_ps(r, _mm256_mul_ps(splat2(p[1], p[5]), c1));
+        r = _mm256_add_ps(r, _mm256_mul_ps(splat2(p[2], p[6]), c2));
+        r = _mm256_add_ps(r, _mm256_mul_ps(splat2(p[3], p[7]), c3));
+        _mm256_storeu_ps(out + i * 4, r);
+    }
+#endif
+    for (; i < count; i++) {
+        mat4_apply(out + i * 4, m, v + i * 4);
+    }
 }
 
 // perspective
@@ -426,33 +528,150 @@ void transform_apply(const transform_t* transform, float* v) {
     mat4_apply(v, transform->transform, v);
 }
 
+// screen space vertex handed to the rasterizers, v holds the packed varyings of the draw
+// with 1/w first and every other attribute divided by w
+typedef struct {
+    float x, y;
+    float v[VARYING_MAX];
+} raster_vertex_t;
+
+static void varyings_init(varyings_t* varyings, int mask) {
+    int n = 1;
+    varyings->mask = mask;
+    varyings->color = varyings->normal = varyings->texcoord = 0;
+    if (mask & VARYING_COLOR) {
+        varyings->color = n;
+        n += 4;
+    }
+    if (mask & VARYING_NORMAL) {
+        varyings->normal = n;
+        n += 3;
+    }
+    if (mask & VARYING_TEXCOORD) {
+        varyings->texcoord = n;
+        n += 2;
+    }
+    varyings->count = n;
+}
+
+static int span_kernel_index(const device_t* device);
+static void lighting_setup(device_t* device, const float* inv_model);
+
+typedef void (*span_kernel_t)(device_t* device, int y, int x0, int x1, const float* origin, const float* ddx, const float* ddy, int ox, int ztest);
+
+// depth only, four untextured kernels and four textured ones per filter and wrap mode
+#define SPAN_KERNEL_COUNT (5 + 4 * 4 * 2)
+
+// the hot loops built for one instruction set, device_simd binds the best one the CPU runs
+typedef struct kernels_s {
+    span_kernel_t span[SPAN_KERNEL_COUNT];  // indexed by span_kernel_index
+    void (*vertex_block)(device_t* device, const float* m, const float* p, int count, int classify, struct post_vertex_s* out);
+    void (*clear)(device_t* device);
+} kernels_t;
+
+// per draw state of the raster stage, varyings and the span kernel follow the bound pointers
+// and the lighting, texture and color mask state
+static void draw_setup(device_t* device, int varyings) {
+    varyings_init(&device->varyings, varyings);
+    device->span_kernel = span_kernel_index(device);
+    if (device->lighting) {
+        // transform_update may have run since the last draw
+        lighting_setup(device, device->transform.inv_model);
+    }
+}
+
+// only what the fragment stage will read: colors if given, normals when lit, texcoords when textured
+static int draw_varyings(const device_t* device) {
+    int mask = 0;
+    if (device->color_pointer) mask |= VARYING_COLOR;
+    if ((device->normal_pointer || device->normal_oct) && device->lighting) mask |= VARYING_NORMAL;
+    if ((device->texcoord_pointer || device->texcoord_u16) && device->texture) mask |= VARYING_TEXCOORD;
+    return mask;
+}
+
+static int simd_requested(void);
+static void tiler_create(device_t* device);
+static void tiler_destroy(device_t* device);
+static void tiler_flush(device_t* device);
+static void tiler_bin(device_t* device, const raster_vertex_t* tri);
+static void hiz_create(device_t* device);
+static void hiz_destroy(device_t* device);
+static void hiz_clear(device_t* device);
+
 void device_init(device_t * device, uint32_t width, uint32_t height) {
+    device_init_threads(device, width, height, 1);
+}
+
+void device_init_threads(device_t * device, uint32_t width, uint32_t height, int threads) {
     device->width = width;
     device->height = height;
     device->framebuffer = (uint32_t*)malloc(width * height * 4);
     device->zbuffer = (float*)malloc(width * height * sizeof(float));
+    hiz_create(device);
     
     device->vertex_pointer = NULL;
     device->normal_pointer = NULL;
     device->texcoord_pointer = NULL;
+    device->vertex_u16 = NULL;
+    device->normal_oct = NULL;
+    device->texcoord_u16 = NULL;
+    device->has_bounds = 0;
     device->color_pointer = NULL;
+    memset(device->buffers, 0, sizeof(device->buffers));
     
     device->lighting = 0;
     memset(device->lights, 0, sizeof(light_t));
     
     device->draw_mode = DEVICE_DRAW_MODE_NORMAL;
+    device->raster_mode = DEVICE_RASTER_SCANLINE;
+    device->subpixel_bits = 4;
+    
+    device->depth_func = DEVICE_DEPTH_LEQUAL;
+    device->depth_write = 1;
+    device->color_write = 1;
+    device->depth_prepass = 0;
     
     device->texture = NULL;
+    device->texture_filter = DEVICE_TEXTURE_NEAREST;
+    device->texture_wrap = DEVICE_TEXTURE_CLAMP;
+    draw_setup(device, VARYING_ALL);
+    device_simd(device, simd_requested());
     
     transform_init(&device->transform, width, height);
+    
+    device->post = NULL;
+    device->post_stamp = NULL;
+    device->post_draw = 0;
+    device->post_capacity = 0;
+    device->vertex_cache_hits = 0;
+    device->vertex_cache_misses = 0;
+    device->instances = NULL;
+    device->instance_capacity = 0;
+    device->instance_normal = NULL;
+    
+    device->threads = MAX(threads, 1);
+    device->tiler = NULL;
+    if (device->threads > 1) {
+        tiler_create(device);
+    }
 }
 
 void device_destroy(device_t *device) {
+    if (device->tiler) tiler_destroy(device);
     if (device->framebuffer) free(device->framebuffer);
     if (device->zbuffer) free(device->zbuffer);
+    hiz_destroy(device);
+    free(device->post);
+    free(device->post_stamp);
+    free(device->instances);
+    
+    for (int i = 0; i < DEVICE_BUFFER_COUNT; i++) {
+        device_del_buffer(device->buffers[i]);
+    }
+    device_del_texture(device->texture);
 }
 
-void device_clear(device_t *device) {
+static void clear_scalar(device_t *device) {
 //    memset(device->framebuffer, 0, device->width * device->height * sizeof(uint32_t));
 //    memset(device->zbuffer, 0, device->width * device->height * sizeof(float));
     int index;
@@ -464,27 +683,167 @@ void device_clear(device_t *device) {
         }
 }
 
+#if defined(DEVICE_DISPATCH)
+TARGET_SSE42
+static void clear_sse42(device_t *device) {
+    const __m128i color = _mm_set1_epi32((int)0xff000000);
+    const __m128 depth = _mm_setzero_ps();
+    int n = device->width * device->height, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i*)(device->framebuffer + i), color);
+        _mm_storeu_ps(device->zbuffer + i, depth);
+    }
+    for (; i < n; i++) {
+        device->framebuffer[i] = 0xff000000;
+        device->zbuffer[i] = 0;
+    }
+}
+
+TARGET_AVX2
+static void clear_avx2(device_t *device) {
+    const __m256i color = _mm256_set1_epi32((int)0xff000000);
+    const __m256 depth = _mm256_setzero_ps();
+    int n = device->width * device->height, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i*)(device->framebuffer + i), color);
+        _mm256_storeu_ps(device->zbuffer + i, depth);
+    }
+    _mm256_zeroupper();
+    for (; i < n; i++) {
+        device->framebuffer[i] = 0xff000000;
+        device->zbuffer[i] = 0;
+    }
+}
+#endif
+
+void device_clear(device_t *device) {
+    device->kernels->clear(device);
+    hiz_clear(device);
+}
+
+// drop the reference of a stream that is bound again
+static void device_release_buffer(device_t *device, int stream) {
+    device_del_buffer(device->buffers[stream]);
+    device->buffers[stream] = NULL;
+}
+
 void device_vertex_pointer(device_t *device, int count, float* pointer) {
+    device_release_buffer(device, DEVICE_BUFFER_VERTEX);
     device->vertex_pointer = pointer;
+    device->vertex_u16 = NULL;
+    device->vertex_count = count;
+    device->has_bounds = 0;
+}
+
+void device_vertex_bounds(device_t *device, const float* min, const float* max) {
+    float r2 = 0;
+    for (int i = 0; i < 3; i++) {
+        device->bounds_center[i] = (min[i] + max[i]) * 0.5f;
+        device->bounds_extent[i] = (max[i] - min[i]) * 0.5f;
+        r2 += device->bounds_extent[i] * device->bounds_extent[i];
+    }
+    device->bounds_radius = sqrtf(r2);
+    device->has_bounds = 1;
+}
+
+void device_vertex_pointer_u16(device_t *device, int count, const uint16_t* pointer, const float* min, const float* max) {
+    device_release_buffer(device, DEVICE_BUFFER_VERTEX);
+    device->vertex_pointer = NULL;
+    device->vertex_u16 = pointer;
     device->vertex_count = count;
+    for (int i = 0; i < 3; i++) {
+        device->vertex_offset[i] = min[i];
+        device->vertex_scale[i] = (max[i] - min[i]) / 65535.0f;
+    }
+    device_vertex_bounds(device, min, max);
 }
 
 void device_normal_pointer(device_t *device, float* pointer) {
+    device_release_buffer(device, DEVICE_BUFFER_NORMAL);
     device->normal_pointer = pointer;
+    device->normal_oct = NULL;
+}
+
+void device_normal_pointer_oct(device_t *device, const uint32_t* pointer) {
+    device_release_buffer(device, DEVICE_BUFFER_NORMAL);
+    device->normal_pointer = NULL;
+    device->normal_oct = pointer;
 }
 
 void device_color_pointer(device_t *device, float* pointer) {
+    device_release_buffer(device, DEVICE_BUFFER_COLOR);
     device->color_pointer = pointer;
 }
 
 void device_texcoord_pointer(device_t *device, float* pointer) {
+    device_release_buffer(device, DEVICE_BUFFER_TEXCOORD);
     device->texcoord_pointer = pointer;
+    device->texcoord_u16 = NULL;
+}
+
+void device_texcoord_pointer_u16(device_t *device, const uint16_t* pointer, const float* min, const float* max) {
+    device_release_buffer(device, DEVICE_BUFFER_TEXCOORD);
+    device->texcoord_pointer = NULL;
+    device->texcoord_u16 = pointer;
+    for (int i = 0; i < 2; i++) {
+        device->texcoord_offset[i] = min[i];
+        device->texcoord_scale[i] = (max[i] - min[i]) / 65535.0f;
+    }
+}
+
+// the new reference is taken before the pointer setter lets go of the old one, which may be the same buffer
+void device_vertex_buffer(device_t *device, int count, buffer_t* buffer) {
+    device_retain_buffer(buffer);
+    device_vertex_pointer(device, count, buffer ? (float*)buffer->data : NULL);
+    device->buffers[DEVICE_BUFFER_VERTEX] = buffer;
+}
+
+void device_normal_buffer(device_t *device, buffer_t* buffer) {
+    device_retain_buffer(buffer);
+    device_normal_pointer(device, buffer ? (float*)buffer->data : NULL);
+    device->buffers[DEVICE_BUFFER_NORMAL] = buffer;
+}
+
+void device_color_buffer(device_t *device, buffer_t* buffer) {
+    device_retain_buffer(buffer);
+    device_color_pointer(device, buffer ? (float*)buffer->data : NULL);
+    device->buffers[DEVICE_BUFFER_COLOR] = buffer;
+}
+
+void device_texcoord_buffer(device_t *device, buffer_t* buffer) {
+    device_retain_buffer(buffer);
+    device_texcoord_pointer(device, buffer ? (float*)buffer->data : NULL);
+    device->buffers[DEVICE_BUFFER_TEXCOORD] = buffer;
 }
 
 void device_draw_mode(device_t *device, int mode) {
     device->draw_mode = mode;
 }
 
+void device_raster_mode(device_t *device, int mode) {
+    device->raster_mode = mode;
+}
+
+void device_subpixel_bits(device_t *device, int bits) {
+    device->subpixel_bits = CLAMP(bits, 1, 8);
+}
+
+void device_depth_func(device_t *device, int func) {
+    device->depth_func = func;
+}
+
+void device_depth_mask(device_t *device, int write) {
+    device->depth_write = write;
+}
+
+void device_color_mask(device_t *device, int write) {
+    device->color_write = write;
+}
+
+void device_depth_prepass(device_t *device, int enable) {
+    device->depth_prepass = enable;
+}
+
 void device_enable_light(device_t *device, int light) {
     device->lighting |= light;
 }
@@ -506,26 +865,155 @@ void device_light(device_t *device, float* postion, float* color, float ka, floa
     device->lights[0].kd = kd;
     device->lights[0].ks = ks;
     device->lights[0].shininess = shininess;
+    
+    lighting_setup(device, device->transform.inv_model);
+}
+
+// position of texel x, y of a level in tex->level_data: rows of 2^tile_shift square tiles, each
+// tile row-major inside, which for a tile_shift of 0 is plain row-major order
+static inline int texel_index(const texture_t* tex, int level, int x, int y) {
+    const int s = tex->tile_shift, m = (1 << s) - 1;
+    return (((y >> s) * tex->level_stride[level] + (x >> s)) << (s * 2)) + ((y & m) << s) + (x & m);
+}
+
+// rounded mean of the four bytes, channel by channel
+static uint32_t texel_average(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t sum = ((a >> shift) & 255) + ((b >> shift) & 255) + ((c >> shift) & 255) + ((d >> shift) & 255) + 2;
+        out |= (sum >> 2) << shift;
+    }
+    return out;
+}
+
+// one mip level from the one above by a 2x2 box filter, odd edges drop their last row or column
+// except where the level above is a single texel wide or high
+static void texture_downsample(uint32_t* dst, int dw, int dh, const uint32_t* src, int sw, int sh) {
+    for (int y = 0; y < dh; y++) {
+        const uint32_t* r0 = src + MIN(y * 2, sh - 1) * sw;
+        const uint32_t* r1 = src + MIN(y * 2 + 1, sh - 1) * sw;
+        uint32_t* out = dst + y * dw;
+        int x = 0;
+        if (sw > 1) {
+#if defined(__SSE2__)
+            // two texels of the level per step: widen to 16 bits, add the rows, then the column pairs
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i two = _mm_set1_epi16(2);
+            for (; x + 2 <= dw; x += 2) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(r0 + x * 2));
+                __m128i b = _mm_loadu_si128((const __m128i*)(r1 + x * 2));
+                __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+                __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+                lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+                hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+                __m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+                _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(sum, sum));
+            }
+#endif
+            for (; x < dw; x++) {
+                out[x] = texel_average(r0[x * 2], r0[x * 2 + 1], r1[x * 2], r1[x * 2 + 1]);
+            }
+        }
+        else {
+            for (; x < dw; x++) {
+                out[x] = texel_average(r0[0], r0[0], r1[0], r1[0]);
+            }
+        }
+    }
+}
+
+// texels of the levels of a width x height chain, rounded up to whole 2^shift square tiles.
+// fills in levels and the level sizes
+static int texture_levels(texture_t* tex, int width, int height, int shift) {
+    int w = width, h = height, m = (1 << shift) - 1, texels = 0;
+    tex->levels = 0;
+    for (;;) {
+        tex->level_width[tex->levels] = w;
+        tex->level_height[tex->levels] = h;
+        texels += ((w + m) & ~m) * ((h + m) & ~m);
+        if (++tex->levels == DEVICE_TEXTURE_LEVELS || (w == 1 && h == 1)) break;
+        w = MAX(w >> 1, 1);
+        h = MAX(h >> 1, 1);
+    }
+    return texels;
+}
+
+// copy the row-major levels in rows into the 4x4 tiles of tex->data
+static void texture_tile(texture_t* tex, const uint32_t* rows) {
+    uint32_t* out = tex->data;
+    for (int i = 0; i < tex->levels; i++) {
+        int w = tex->level_width[i], h = tex->level_height[i];
+        tex->level_stride[i] = (w + 3) >> 2;
+        tex->level_data[i] = out;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                out[texel_index(tex, i, x, y)] = rows[y * w + x];
+            }
+        }
+        rows += w * h;
+        out += tex->level_stride[i] * ((h + 3) >> 2) * 16;
+    }
 }
 
 texture_t* device_gen_texture(int type, int width, int height, uint8_t* data) {
     texture_t* tex = (texture_t*)malloc(sizeof(texture_t));
+    if (!tex) return NULL;
     tex->type = type;
     tex->width = width;
     tex->height = height;
+    tex->tile_shift = type == DEVICE_TEXTURE_TILED ? 2 : 0;
+    
+    // the whole mip chain in one block, built row-major and then tiled if asked for
+    int texels = texture_levels(tex, width, height, 0);
+    void* rows = NULL;
+    if (posix_memalign(&rows, 64, texels * sizeof(uint32_t)) != 0) {
+        free(tex);
+        return NULL;
+    }
     
     int row_size = width * 4, index1 = 0, index2 = (height - 1) * row_size;
-    uint8_t* p = (uint8_t*)malloc(row_size * height);
+    uint8_t* p = (uint8_t*)rows;
     for (int i = 0; i < height; i++, index1 += row_size, index2 -= row_size) {
         memcpy(p + index1, data + index2, row_size);
     }
     
-    tex->data = (uint32_t*)p;
+    uint32_t* level = (uint32_t*)rows;
+    for (int i = 0; i < tex->levels; i++) {
+        tex->level_stride[i] = tex->level_width[i];
+        tex->level_data[i] = level;
+        if (i > 0) {
+            texture_downsample(level, tex->level_width[i], tex->level_height[i], tex->level_data[i - 1],
+                               tex->level_width[i - 1], tex->level_height[i - 1]);
+        }
+        level += tex->level_width[i] * tex->level_height[i];
+    }
+    tex->data = (uint32_t*)rows;
+    
+    if (tex->tile_shift) {
+        void* tiles = NULL;
+        texels = texture_levels(tex, width, height, tex->tile_shift);
+        if (posix_memalign(&tiles, 64, texels * sizeof(uint32_t)) != 0) {
+            free(rows);
+            free(tex);
+            return NULL;
+        }
+        memset(tiles, 0, texels * sizeof(uint32_t));
+        tex->data = (uint32_t*)tiles;
+        texture_tile(tex, (const uint32_t*)rows);
+        free(rows);
+    }
     
+    tex->refcount = 1;
+    return tex;
+}
+
+texture_t* device_retain_texture(texture_t* tex) {
+    if (tex) __atomic_add_fetch(&tex->refcount, 1, __ATOMIC_RELAXED);
     return tex;
 }
 
 void device_del_texture(texture_t* tex) {
+    if (!tex || __atomic_sub_fetch(&tex->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
     free(tex->data);
     free(tex);
 }
@@ -535,15 +1023,63 @@ void device_update_texture(texture_t* tex, int x, int y, int w, int h) {
 }
 
 void device_bind_texture(device_t *device, texture_t* tex) {
+    device_retain_texture(tex);
+    device_del_texture(device->texture);
     device->texture = tex;
 }
 
-void draw_pixel(device_t* device, int x, int y, uint32_t color) {
-    if (x >= 0 && x < device->width && y >= 0 && y < device->height) {
+void device_texture_filter(device_t *device, int filter) {
+    device->texture_filter = filter;
+}
+
+void device_texture_wrap(device_t *device, int wrap) {
+    device->texture_wrap = wrap;
+}
+
+buffer_t* device_gen_buffer(const void* data, int size) {
+    buffer_t* buffer = (buffer_t*)malloc(sizeof(buffer_t));
+    buffer->data = malloc(size);
+    memcpy(buffer->data, data, size);
+    buffer->size = size;
+    buffer->refcount = 1;
+    return buffer;
+}
+
+buffer_t* device_retain_buffer(buffer_t* buffer) {
+    if (buffer) __atomic_add_fetch(&buffer->refcount, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+void device_del_buffer(buffer_t* buffer) {
+    if (!buffer || __atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+    free(buffer->data);
+    free(buffer);
+}
+
+// [x0, x1) x [y0, y1) region of the framebuffer a rasterizer may write to
+typedef struct {
+    int x0, y0, x1, y1;
+} rect_t;
+
+static void device_rect(const device_t* device, rect_t* rect) {
+    rect->x0 = 0;
+    rect->y0 = 0;
+    rect->x1 = device->width;
+    rect->y1 = device->height;
+}
+
+static void plot_pixel(device_t* device, const rect_t* clip, int x, int y, uint32_t color) {
+    if (x >= clip->x0 && x < clip->x1 && y >= clip->y0 && y < clip->y1) {
         device->framebuffer[y * device->width + x] = color;
     }
 }
 
+void draw_pixel(device_t* device, int x, int y, uint32_t color) {
+    rect_t rect;
+    device_rect(device, &rect);
+    plot_pixel(device, &rect, x, y, color);
+}
+
 static uint8_t float_to_byte(float f) {
     int r = ROUND(f * 255);
     r = CLAMP(r, 0, 255);
@@ -573,21 +1109,21 @@ void vertex_interp(vertex_t* out, const vertex_t* v1, const vertex_t* v2, float
     out->oneoverz = interp(v1->oneoverz, v2->oneoverz, t);
 }
 
-void draw_line(device_t* device, int x1, int y1, int x2, int y2, uint32_t color) {
+static void draw_line_clipped(device_t* device, const rect_t* clip, int x1, int y1, int x2, int y2, uint32_t color) {
     int x, y;
     if (x1 == x2 && y1 == y2) {
-        draw_pixel(device, x1, y1, color);
+        plot_pixel(device, clip, x1, y1, color);
     }
     else if (x1 == x2) {
         int inc = y1 > y2 ? -1 : 1;
         for (y = y1; y != y2; y += inc) {
-            draw_pixel(device, x1, y, color);
+            plot_pixel(device, clip, x1, y, color);
         }
     }
     else if (y1 == y2) {
         int inc = x1 > x2 ? -1 : 1;
         for (x = x1; x != x2; x += inc) {
-            draw_pixel(device, x, y1, color);
+            plot_pixel(device, clip, x, y1, color);
         }
     }
     else {
@@ -605,16 +1141,16 @@ void draw_line(device_t* device, int x1, int y1, int x2, int y2, uint32_t color)
             }
             inc = y1 > y2 ? -1 : 1;
             for (x = x1, y = y1; x <= x2; x++) {
-                draw_pixel(device, x, y, color);
+                plot_pixel(device, clip, x, y, color);
                 
                 rem += dy;
                 if (rem >= dx) {
                     rem -= dx;
                     y += inc;
-                    draw_pixel(device, x, y, color);
+                    plot_pixel(device, clip, x, y, color);
                 }
             }
-            draw_pixel(device, x2, y2, color);
+            plot_pixel(device, clip, x2, y2, color);
         }
         else {
             if (y2 < y1) {
@@ -627,21 +1163,27 @@ void draw_line(device_t* device, int x1, int y1, int x2, int y2, uint32_t color)
             }
             inc = x1 > x2 ? -1 : 1;
             for (x = x1, y = y1; y <= y2; y++) {
-                draw_pixel(device, x, y, color);
+                plot_pixel(device, clip, x, y, color);
                 
                 rem += dx;
                 if (rem >= dy) {
                     rem -= dy;
                     x += inc;
-                    draw_pixel(device, x, y, color);
+                    plot_pixel(device, clip, x, y, color);
                 }
             }
             
-            draw_pixel(device, x2, y2, color);
+            plot_pixel(device, clip, x2, y2, color);
         }
     }
 }
 
+void draw_line(device_t* device, int x1, int y1, int x2, int y2, uint32_t color) {
+    rect_t rect;
+    device_rect(device, &rect);
+    draw_line_clipped(device, &rect, x1, y1, x2, y2, color);
+}
+
 static void perspective_division(float *v) {
     if (v[3] == 0) return;
     float inv = 1 / v[3];
@@ -651,15 +1193,44 @@ static void perspective_division(float *v) {
     v[3] = 1;
 }
 
-static void cvv_to_view_port(float *v, int w, int h) {
-    v[0] = (int)(w * (v[0] + 1) * 0.5f);
-    v[1] = (int)(w * (v[1] + 1) * 0.5f);
+// subpixel_bits 0 truncates to whole pixels, otherwise positions are rounded to 1 / 2^bits of a pixel
+static void cvv_to_view_port(float *v, int w, int h, int subpixel_bits) {
+    if (subpixel_bits) {
+        float one = (float)(1 << subpixel_bits);
+        v[0] = rintf(w * (v[0] + 1) * 0.5f * one) / one;
+        v[1] = rintf(h * (v[1] + 1) * 0.5f * one) / one;
+    }
+    else {
+        v[0] = (int)(w * (v[0] + 1) * 0.5f);
+        v[1] = (int)(h * (v[1] + 1) * 0.5f);
+    }
+}
+
+// out = a + (b - a) * t
+static void varying_lerp(float* out, const float* a, const float* b, float t, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] + (b[i] - a[i]) * t;
+    }
+}
+
+// out = v + step * k
+static void varying_step(float* out, const float* v, const float* step, float k, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = v[i] + step[i] * k;
+    }
+}
+
+// out = (v1 - v0) * k1 + (v2 - v0) * k2
+static void varying_gradient(float* out, const float* v0, const float* v1, const float* v2, float k1, float k2, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = (v1[i] - v0[i]) * k1 + (v2[i] - v0[i]) * k2;
+    }
 }
 
-static void sort_vertices_by_y(vertex_t* v1, vertex_t* v2, vertex_t* v3,
-                               vertex_t** top, vertex_t** middle, vertex_t** bottom) {
-    if (v1->position[1] > v2->position[1]) {
-        if (v1->position[1] > v3->position[1]) {
+static void sort_vertices_by_y(const raster_vertex_t* v1, const raster_vertex_t* v2, const raster_vertex_t* v3,
+                               const raster_vertex_t** top, const raster_vertex_t** middle, const raster_vertex_t** bottom) {
+    if (v1->y > v2->y) {
+        if (v1->y > v3->y) {
             *top = v1;
             *middle = v2;
             *bottom = v3;
@@ -671,7 +1242,7 @@ static void sort_vertices_by_y(vertex_t* v1, vertex_t* v2, vertex_t* v3,
         }
     }
     else {
-        if (v2->position[1] > v3->position[1]) {
+        if (v2->y > v3->y) {
             *top = v2;
             *middle = v1;
             *bottom = v3;
@@ -683,8 +1254,8 @@ static void sort_vertices_by_y(vertex_t* v1, vertex_t* v2, vertex_t* v3,
         }
     }
     
-    if ((*middle)->position[1] < (*bottom)->position[1]) {
-        vertex_t* t = *middle;
+    if ((*middle)->y < (*bottom)->y) {
+        const raster_vertex_t* t = *middle;
         *middle = *bottom;
         *bottom = t;
     }
@@ -705,135 +1276,573 @@ static void vertex_pre_process(vertex_t* v) {
     v->color[3] *= oneoverz;
 }
 
-static void vertex_division(vertex_t *out, const vertex_t *v1, const vertex_t *v2, float w) {
-    float inv = 1.0f / w;
-    out->position[0] = (v2->position[0] - v1->position[0]) * inv;
-    out->position[1] = (v2->position[1] - v1->position[1]) * inv;
-    out->position[2] = (v2->position[2] - v1->position[2]) * inv;
-    out->position[3] = (v2->position[3] - v1->position[3]) * inv;
-    out->normal[0] = (v2->normal[0] - v1->normal[0]) * inv;
-    out->normal[1] = (v2->normal[1] - v1->normal[1]) * inv;
-    out->normal[2] = (v2->normal[2] - v1->normal[2]) * inv;
-    out->normal[3] = (v2->normal[3] - v1->normal[3]) * inv;
-    out->texcoord[0] = (v2->texcoord[0] - v1->texcoord[0]) * inv;
-    out->texcoord[1] = (v2->texcoord[1] - v1->texcoord[1]) * inv;
-    out->color[0] = (v2->color[0] - v1->color[0]) * inv;
-    out->color[1] = (v2->color[1] - v1->color[1]) * inv;
-    out->color[2] = (v2->color[2] - v1->color[2]) * inv;
-    out->color[3] = (v2->color[3] - v1->color[3]) * inv;
-    out->oneoverz = (v2->oneoverz - v1->oneoverz) * inv;
-}
-
-static void vertex_add(vertex_t *out, const vertex_t *v) {
-    out->position[0] += v->position[0];
-    out->position[1] += v->position[1];
-    out->position[2] += v->position[2];
-    out->position[3] += v->position[3];
-    out->normal[0] += v->normal[0];
-    out->normal[1] += v->normal[1];
-    out->normal[2] += v->normal[2];
-    out->normal[3] += v->normal[3];
-    out->texcoord[0] += v->texcoord[0];
-    out->texcoord[1] += v->texcoord[1];
-    out->color[0] += v->color[0];
-    out->color[1] += v->color[1];
-    out->color[2] += v->color[2];
-    out->color[3] += v->color[3];
-    out->oneoverz += v->oneoverz;
-}
+#define CLIP_LEFT 1
+#define CLIP_RIGHT 2
+#define CLIP_BOTTOM 4
+#define CLIP_TOP 8
+#define CLIP_NEAR 16
+#define CLIP_FAR 32
+#define GUARD_LEFT 64
+#define GUARD_RIGHT 128
+#define GUARD_BOTTOM 256
+#define GUARD_TOP 512
+
+#define CLIP_VIEW (CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR)
+// planes that are actually clipped against, the side planes are left to the rasterizer
+#define CLIP_GEOMETRY (CLIP_NEAR | CLIP_FAR | GUARD_LEFT | GUARD_RIGHT | GUARD_BOTTOM | GUARD_TOP)
+
+// guard band in ndc units, x and y within [-GUARD_BAND, GUARD_BAND] are rasterized unclipped
+// and stay well inside float and fixed point precision for the edge functions
+#define GUARD_BAND 2.0f
 
 static int check_cvv(const float* v) {
     float w = v[3];
+    float g = w * GUARD_BAND;
     int check = 0;
     
-    if (v[0] < -w) check |= 1;
-    if (v[0] >  w) check |= 2;
-    if (v[1] < -w) check |= 4;
-    if (v[1] >  w) check |= 8;
-    if (v[2] < 0) check |= 16;
-    if (v[2] >  w) check |= 32;
+    if (v[0] < -w) check |= CLIP_LEFT;
+    if (v[0] >  w) check |= CLIP_RIGHT;
+    if (v[1] < -w) check |= CLIP_BOTTOM;
+    if (v[1] >  w) check |= CLIP_TOP;
+    if (v[2] < -w) check |= CLIP_NEAR;
+    if (v[2] >  w) check |= CLIP_FAR;
+    if (v[0] < -g) check |= GUARD_LEFT;
+    if (v[0] >  g) check |= GUARD_RIGHT;
+    if (v[1] < -g) check |= GUARD_BOTTOM;
+    if (v[1] >  g) check |= GUARD_TOP;
     
     return check;
 }
 
+// signed distance to a clip plane, inside when >= 0
+static float clip_distance(const float* v, int plane) {
+    float g = v[3] * GUARD_BAND;
+    switch (plane) {
+        case CLIP_NEAR: return v[2] + v[3];
+        case CLIP_FAR: return v[3] - v[2];
+        case GUARD_LEFT: return v[0] + g;
+        case GUARD_RIGHT: return g - v[0];
+        case GUARD_BOTTOM: return v[1] + g;
+        default: return g - v[1];
+    }
+}
+
+// a polygon clipped by one triangle against six planes has at most nine vertices
+#define CLIP_MAX_VERTICES 9
+
+// Sutherland-Hodgman against one plane in clip space, where every attribute is still linear
+static int clip_polygon(const vertex_t* in, int count, vertex_t* out, int plane) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const vertex_t* a = &in[i];
+        const vertex_t* b = &in[(i + 1) % count];
+        float da = clip_distance(a->position, plane);
+        float db = clip_distance(b->position, plane);
+        
+        if (da >= 0) {
+            out[n++] = *a;
+        }
+        if ((da >= 0) != (db >= 0)) {
+            float t = da / (da - db);
+            vertex_interp(&out[n], a, b, t);
+            out[n].position[3] = interp(a->position[3], b->position[3], t);
+            n++;
+        }
+    }
+    return n;
+}
+
 typedef struct {
-    vertex_t v, step;
+    float v[VARYING_MAX], step[VARYING_MAX];
     int x, y, w;
 } scanline_t;
 
-static void scanline_init(scanline_t* scanline, vertex_t* left, vertex_t* right, int y) {
-    scanline->x = (int)(left->position[0] + 0.5);
+static void scanline_init(scanline_t* scanline, const raster_vertex_t* left, const raster_vertex_t* right, int y, int n) {
+    scanline->x = (int)(left->x + 0.5);
     scanline->y = y;
-    scanline->w = (int)(right->position[0] + 0.5) - scanline->x;
-    scanline->v = *left;
+    scanline->w = (int)(right->x + 0.5) - scanline->x;
     
-    float width = right->position[0] - left->position[0];
-    vertex_division(&scanline->step, left, right, width);
+    float inv = 1.0f / (right->x - left->x);
+    for (int i = 0; i < n; i++) {
+        scanline->v[i] = left->v[i];
+        scanline->step[i] = (right->v[i] - left->v[i]) * inv;
+    }
 }
 
 typedef struct {
     uint8_t r, g, b, a;
 } color_t;
 
-static color_t device_texture_read(device_t* device, float u, float v) {
-    texture_t* tex = device->texture;
-    u = u * (tex->width - 1);
-    v = v * (tex->height - 1);
-    int x = CLAMP((int)(u + 0.5f), 0, tex->width - 1);
-    int y = CLAMP((int)(v + 0.5f), 0, tex->height - 1);
-    uint32_t c = tex->data[y * tex->width + x];
-    color_t color = *((color_t*)(&c));
-    return color;
+// texels are kept as the rgba bytes of color_t, these work on them channel by channel
+// a + (b - a) * t / 256
+static uint32_t texel_lerp(uint32_t a, uint32_t b, int t) {
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t ca = (a >> shift) & 255, cb = (b >> shift) & 255;
+        out |= ((ca * (256 - t) + cb * t + 128) >> 8) << shift;
+    }
+    return out;
 }
 
-static void process_lighting(device_t* device, float* normal, float* color) {
+// x wrapped into 0 .. size - 1, by a mask when size is a power of two
+static inline int texel_wrap(int x, int size) {
+    if (!(size & (size - 1))) return x & (size - 1);
+    x %= size;
+    return x < 0 ? x + size : x;
+}
+
+// u wrapped into [0, 1) before anything is converted to int, the subtraction is exact. NaN and
+// infinities end up at 0, the same as in texel_pair4
+static inline float texel_repeat(float u) {
+    float f = u - floorf(u);
+    return f < 1 ? f : 0;
+}
+
+// nearest texel column of u across size texels. clamped texel centers are at u * (size - 1),
+// repeated ones at (x + 0.5) / size so the texture tiles every 1.0 of u
+static inline __attribute__((always_inline))
+int texel_nearest(float u, int size, int wrap) {
+    if (wrap == DEVICE_TEXTURE_REPEAT) {
+        // f * size may round up to size, which wraps to 0
+        return texel_wrap((int)(texel_repeat(u) * size), size);
+    }
+    u = u * (size - 1);
+    return CLAMP((int)(u + 0.5f), 0, size - 1);
+}
+
+// the two texel columns around u across size texels, returns the weight of x1 in 0 .. 255
+static inline __attribute__((always_inline))
+int texel_pair(float u, int size, int wrap, int* x0, int* x1) {
+    if (wrap == DEVICE_TEXTURE_REPEAT) {
+        float s = texel_repeat(u) * size - 0.5f;
+        int x = (int)s;
+        x -= s < x;
+        *x0 = texel_wrap(x, size);
+        *x1 = texel_wrap(x + 1, size);
+        return (int)((s - x) * 256);
+    }
+    // NaN clamps to 0 like in texel_pair4
+    u = (u > 0 ? MIN(u, 1.0f) : 0) * (size - 1);
+    int x = (int)u;
+    *x0 = x;
+    *x1 = MIN(x + 1, size - 1);
+    return (int)((u - x) * 256);
+}
+
+// the samplers are always inlined into span_shade, where wrap and filter are constants of the
+// kernel, so no kernel tests addressing or filter state per pixel
+static inline __attribute__((always_inline))
+uint32_t texture_nearest(const texture_t* tex, int level, int wrap, float u, float v) {
+    int x = texel_nearest(u, tex->level_width[level], wrap);
+    int y = texel_nearest(v, tex->level_height[level], wrap);
+    return tex->level_data[level][texel_index(tex, level, x, y)];
+}
+
+// the four texels around u, v blended with 8 bit weights
+static inline __attribute__((always_inline))
+uint32_t texture_bilinear(const texture_t* tex, int level, int wrap, float u, float v) {
+    int x0, x1, y0, y1;
+    int fx = texel_pair(u, tex->level_width[level], wrap, &x0, &x1);
+    int fy = texel_pair(v, tex->level_height[level], wrap, &y0, &y1);
+    const uint32_t* texels = tex->level_data[level];
+    uint32_t c00 = texels[texel_index(tex, level, x0, y0)], c10 = texels[texel_index(tex, level, x1, y0)];
+    uint32_t c01 = texels[texel_index(tex, level, x0, y1)], c11 = texels[texel_index(tex, level, x1, y1)];
+    return texel_lerp(texel_lerp(c00, c10, fx), texel_lerp(c01, c11, fx), fy);
+}
+
+#if defined(__SSE2__)
+// texel_pair of four coordinates, the weights are returned in the 32 bit lanes
+static inline __attribute__((always_inline))
+__m128i texel_pair4(const float* coords, int size, int wrap, int* x0, int* x1) {
+    __m128 u = _mm_loadu_ps(coords);
+    __m128i x;
+    __m128 f;
+    if (wrap == DEVICE_TEXTURE_REPEAT) {
+        if (size & (size - 1)) {
+            int weights[4];
+            for (int i = 0; i < 4; i++) {
+                weights[i] = texel_pair(coords[i], size, wrap, &x0[i], &x1[i]);
+            }
+            return _mm_loadu_si128((const __m128i*)weights);
+        }
+        // texel_repeat: floats from 2^23 up are whole numbers and wrap to 0 like NaN and
+        // infinities, which the compare also fails, the rest is floored exactly through int
+        __m128 magnitude = _mm_andnot_ps(_mm_set1_ps(-0.0f), u);
+        u = _mm_and_ps(u, _mm_cmplt_ps(magnitude, _mm_set1_ps(8388608.0f)));
+        __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(u));
+        whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, u), _mm_set1_ps(1)));
+        u = _mm_sub_ps(u, whole);
+        
+        __m128 s = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps((float)size)), _mm_set1_ps(0.5f));
+        x = _mm_cvttps_epi32(s);
+        // truncation to floor, the compare mask is -1 where s is below x
+        x = _mm_add_epi32(x, _mm_castps_si128(_mm_cmplt_ps(s, _mm_cvtepi32_ps(x))));
+        f = _mm_sub_ps(s, _mm_cvtepi32_ps(x));
+        __m128i mask = _mm_set1_epi32(size - 1);
+        _mm_storeu_si128((__m128i*)x0, _mm_and_si128(x, mask));
+        _mm_storeu_si128((__m128i*)x1, _mm_and_si128(_mm_sub_epi32(x, _mm_set1_epi32(-1)), mask));
+    }
+    else {
+        u = _mm_min_ps(_mm_max_ps(u, _mm_setzero_ps()), _mm_set1_ps(1));
+        u = _mm_mul_ps(u, _mm_set1_ps((float)(size - 1)));
+        x = _mm_cvttps_epi32(u);
+        f = _mm_sub_ps(u, _mm_cvtepi32_ps(x));
+        _mm_storeu_si128((__m128i*)x0, x);
+        _mm_storeu_si128((__m128i*)x1, _mm_sub_epi32(x, _mm_cmplt_epi32(x, _mm_set1_epi32(size - 1))));
+    }
+    return _mm_cvttps_epi32(_mm_mul_ps(f, _mm_set1_ps(256)));
+}
+
+// texel_lerp of the 16 bit channels of two texels per register
+static inline __m128i texel_lerp2(__m128i a, __m128i b, __m128i t) {
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(_mm_set1_epi16(256), t)), _mm_mullo_epi16(b, t));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+#endif
+
+// texture_bilinear of level 0 at four points at once: addressing and weights four wide, the
+// blends two pixels per register, out is bit for bit what texture_bilinear returns
+static inline __attribute__((always_inline))
+void texture_bilinear4(const texture_t* tex, int wrap, const float* u, const float* v, uint32_t* out) {
+#if defined(__SSE2__)
+    int x0[4], x1[4], y0[4], y1[4];
+    __m128i fx = texel_pair4(u, tex->width, wrap, x0, x1);
+    __m128i fy = texel_pair4(v, tex->height, wrap, y0, y1);
+    
+    uint32_t c00[4], c10[4], c01[4], c11[4];
+    for (int i = 0; i < 4; i++) {
+        c00[i] = tex->data[texel_index(tex, 0, x0[i], y0[i])];
+        c10[i] = tex->data[texel_index(tex, 0, x1[i], y0[i])];
+        c01[i] = tex->data[texel_index(tex, 0, x0[i], y1[i])];
+        c11[i] = tex->data[texel_index(tex, 0, x1[i], y1[i])];
+    }
+    __m128i a = _mm_loadu_si128((const __m128i*)c00), b = _mm_loadu_si128((const __m128i*)c10);
+    __m128i c = _mm_loadu_si128((const __m128i*)c01), d = _mm_loadu_si128((const __m128i*)c11);
+    
+    // each weight spread over the four channels of its pixel, pixels 0, 1 in lo and 2, 3 in hi
+    __m128i gx = _mm_unpacklo_epi16(_mm_packs_epi32(fx, fx), _mm_packs_epi32(fx, fx));
+    __m128i gy = _mm_unpacklo_epi16(_mm_packs_epi32(fy, fy), _mm_packs_epi32(fy, fy));
+    __m128i wx_lo = _mm_unpacklo_epi32(gx, gx), wx_hi = _mm_unpackhi_epi32(gx, gx);
+    __m128i wy_lo = _mm_unpacklo_epi32(gy, gy), wy_hi = _mm_unpackhi_epi32(gy, gy);
+    
+    const __m128i zero = _mm_setzero_si128();
+    __m128i top = texel_lerp2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), wx_lo);
+    __m128i bottom = texel_lerp2(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero), wx_lo);
+    __m128i lo = texel_lerp2(top, bottom, wy_lo);
+    top = texel_lerp2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), wx_hi);
+    bottom = texel_lerp2(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero), wx_hi);
+    __m128i hi = texel_lerp2(top, bottom, wy_hi);
+    _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(lo, hi));
+#else
+    for (int i = 0; i < 4; i++) {
+        out[i] = texture_bilinear(tex, 0, wrap, u[i], v[i]);
+    }
+#endif
+}
+
+// log2 from the exponent and a linear mantissa, at most 0.09 off, which only moves the point
+// where one level hands over to the next
+static float fast_log2(float x) {
+    union { float f; uint32_t i; } bits = {x};
+    return (float)bits.i * (1.0f / (1 << 23)) - 127;
+}
+
+// mip level of the 2x2 pixel quad n pixels right and m rows down of the span origin: log2 of the
+// longer texel footprint of a step in x or y, from the derivatives of u = (u / w) / (1 / w) and v.
+// every pixel of the quad gets the same level whichever span or tile shades it
+static inline __attribute__((always_inline))
+float quad_lod(const texture_t* tex, int wrap, const float* origin, const float* ddx, const float* ddy, int texcoord, float n, float m) {
+    const float* t0 = origin + texcoord;
+    const float* tdx = ddx + texcoord;
+    const float* tdy = ddy + texcoord;
+    float w = 1 / (origin[0] + ddx[0] * n + ddy[0] * m);
+    float u = (t0[0] + tdx[0] * n + tdy[0] * m) * w;
+    float v = (t0[1] + tdx[1] * n + tdy[1] * m) * w;
+    // texels per unit of u and v, as texel_nearest and texel_pair address them
+    int repeat = wrap == DEVICE_TEXTURE_REPEAT;
+    float sx = (float)(repeat ? tex->width : tex->width - 1), sy = (float)(repeat ? tex->height : tex->height - 1);
+    float dudx = (tdx[0] - u * ddx[0]) * w * sx, dvdx = (tdx[1] - v * ddx[0]) * w * sy;
+    float dudy = (tdy[0] - u * ddy[0]) * w * sx, dvdy = (tdy[1] - v * ddy[0]) * w * sy;
+    float lod = 0.5f * fast_log2(MAX(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy));
+    if (!(lod > 0)) return 0;
+    return MIN(lod, (float)(tex->levels - 1));
+}
+
+// texel at u, v of the mipmapped filters
+static inline __attribute__((always_inline))
+uint32_t texture_sample(const texture_t* tex, int filter, int wrap, float lod, float u, float v) {
+    if (filter == DEVICE_TEXTURE_NEAREST_MIPMAP) {
+        return texture_nearest(tex, (int)(lod + 0.5f), wrap, u, v);
+    }
+    int level = (int)lod;
+    int t = (int)((lod - level) * 256);
+    uint32_t c = texture_bilinear(tex, level, wrap, u, v);
+    if (t == 0 || level + 1 >= tex->levels) return c;
+    return texel_lerp(c, texture_bilinear(tex, level + 1, wrap, u, v), t);
+}
+
+// light direction and half vector in the space inv_model maps world space to, the model space
+// of transform.model or world space itself for instanced draws
+static void lighting_setup(device_t* device, const float* inv_model) {
     light_t * lt = &(device->lights[0]);
-    float light[4] = {lt->postion[0], lt->postion[1], lt->postion[2], 0};
-    mat4_apply(light, device->transform.inv_model, light);
+    float* light = device->light_dir;
+    light[0] = lt->postion[0], light[1] = lt->postion[1], light[2] = lt->postion[2], light[3] = 0;
+    mat4_apply(light, inv_model, light);
     vec4_normalize(light);
     
     float eye[4] = {0, 0, 3, 0};
-    mat4_apply(eye, device->transform.inv_model, eye);
+    mat4_apply(eye, inv_model, eye);
     vec4_normalize(eye);
     
-    float halfLE[4];
-    vec4_add(halfLE, light, eye);
-    vec4_normalize(halfLE);
+    vec4_add(device->light_half, light, eye);
+    vec4_normalize(device->light_half);
+}
+
+static void process_lighting(device_t* device, float* normal, float* color) {
+    light_t * lt = &(device->lights[0]);
     
     vec4_normalize(normal);
     
-    float diffuse = vec4_dot(normal, light);
+    float diffuse = vec4_dot(normal, device->light_dir);
     diffuse = lt->kd * MAX(diffuse, 0);
     
-    float specular = vec4_dot(normal, halfLE);
+    float specular = vec4_dot(normal, device->light_half);
     specular = lt->ks * powf(MAX(specular, 0), lt->shininess);
     
-    color[0] *= ((lt->ka + diffuse + specular) * lt->color[0]);
-    color[1] *= ((lt->ka + diffuse + specular) * lt->color[1]);
-    color[2] *= ((lt->ka + diffuse + specular) * lt->color[2]);
-}
-
-static void draw_scanline(device_t* device, scanline_t* scanline) {
-    int left = scanline->x;
-    int right = left + scanline->w;
-    float z;
-    float color[4], normal[4];
-    int index = scanline->y * device->width + left;
-    vertex_t* v = &scanline->v;
-    for (; left < right; left++, index++) {
-        if (left >= 0 && left < device->width && device->zbuffer[index] <= v->oneoverz) {
-            z = 1 / v->oneoverz;
-            color[0] = v->color[0] * z, color[1] = v->color[1] * z, color[2] = v->color[2] * z, color[3] = v->color[3] * z;
-            normal[0] = v->normal[0] * z, normal[1] = v->normal[1] * z, normal[2] = v->normal[2] * z, normal[3] = 0;
+    float intensity = lt->ka + diffuse + specular;
+    color[0] *= (intensity * lt->color[0]);
+    color[1] *= (intensity * lt->color[1]);
+    color[2] *= (intensity * lt->color[2]);
+}
+
+//===================================================================
+//hierarchical z
+//===================================================================
+
+static void hiz_create(device_t* device) {
+    hiz_t* hiz = &device->hiz;
+    hiz->width = (device->width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    hiz->height = (device->height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    hiz->tiles_x = (device->width + DEVICE_TILE_SIZE - 1) / DEVICE_TILE_SIZE;
+    hiz->tiles_y = (device->height + DEVICE_TILE_SIZE - 1) / DEVICE_TILE_SIZE;
+    hiz->block_far = (float*)malloc(hiz->width * hiz->height * sizeof(float));
+    hiz->block_near = (float*)malloc(hiz->width * hiz->height * sizeof(float));
+    hiz->block_dirty = (uint8_t*)malloc(hiz->width * hiz->height);
+    hiz->tile_far = (float*)malloc(hiz->tiles_x * hiz->tiles_y * sizeof(float));
+    hiz->tile_dirty = (uint8_t*)malloc(hiz->tiles_x * hiz->tiles_y);
+    hiz_clear(device);
+}
+
+static void hiz_destroy(device_t* device) {
+    hiz_t* hiz = &device->hiz;
+    free(hiz->block_far);
+    free(hiz->block_near);
+    free(hiz->block_dirty);
+    free(hiz->tile_far);
+    free(hiz->tile_dirty);
+}
+
+static void hiz_clear(device_t* device) {
+    hiz_t* hiz = &device->hiz;
+    int blocks = hiz->width * hiz->height;
+    for (int i = 0; i < blocks; i++) {
+        hiz->block_far[i] = 0;
+        hiz->block_near[i] = 0;
+    }
+    memset(hiz->block_dirty, 0, blocks);
+    for (int i = 0; i < hiz->tiles_x * hiz->tiles_y; i++) {
+        hiz->tile_far[i] = 0;
+    }
+    memset(hiz->tile_dirty, 0, hiz->tiles_x * hiz->tiles_y);
+}
+
+// called for every depth write, far bounds are lowered right away (depth funcs other than
+// LESS / LEQUAL may move a pixel away) and raised lazily when queried
+static void hiz_write(device_t* device, int x, int y, float z) {
+    hiz_t* hiz = &device->hiz;
+    int block = (y / BLOCK_SIZE) * hiz->width + x / BLOCK_SIZE;
+    int tile = (y / DEVICE_TILE_SIZE) * hiz->tiles_x + x / DEVICE_TILE_SIZE;
+    if (z > hiz->block_near[block]) hiz->block_near[block] = z;
+    if (z < hiz->block_far[block]) hiz->block_far[block] = z;
+    if (z < hiz->tile_far[tile]) hiz->tile_far[tile] = z;
+    hiz->block_dirty[block] = 1;
+    hiz->tile_dirty[tile] = 1;
+}
+
+static float hiz_block_far(device_t* device, int bx, int by) {
+    hiz_t* hiz = &device->hiz;
+    int block = by * hiz->width + bx;
+    if (hiz->block_dirty[block]) {
+        int x0 = bx * BLOCK_SIZE, x1 = MIN(x0 + BLOCK_SIZE, (int)device->width);
+        int y0 = by * BLOCK_SIZE, y1 = MIN(y0 + BLOCK_SIZE, (int)device->height);
+        float far = device->zbuffer[y0 * device->width + x0];
+        for (int y = y0; y < y1; y++) {
+            const float* z = &device->zbuffer[y * device->width];
+            for (int x = x0; x < x1; x++) {
+                far = MIN(far, z[x]);
+            }
+        }
+        hiz->block_far[block] = far;
+        hiz->block_dirty[block] = 0;
+    }
+    return hiz->block_far[block];
+}
+
+static float hiz_tile_far(device_t* device, int tx, int ty) {
+    hiz_t* hiz = &device->hiz;
+    int tile = ty * hiz->tiles_x + tx;
+    if (hiz->tile_dirty[tile]) {
+        const int n = DEVICE_TILE_SIZE / BLOCK_SIZE;
+        int bx1 = MIN((tx + 1) * n, hiz->width);
+        int by1 = MIN((ty + 1) * n, hiz->height);
+        float far = hiz_block_far(device, tx * n, ty * n);
+        for (int by = ty * n; by < by1; by++) {
+            for (int bx = tx * n; bx < bx1; bx++) {
+                far = MIN(far, hiz_block_far(device, bx, by));
+            }
+        }
+        hiz->tile_far[tile] = far;
+        hiz->tile_dirty[tile] = 0;
+    }
+    return hiz->tile_far[tile];
+}
+
+// stored and z are 1/w, so nearer means larger
+static int depth_test(int func, float stored, float z) {
+    switch (func) {
+        case DEVICE_DEPTH_NEVER: return 0;
+        case DEVICE_DEPTH_LESS: return z > stored;
+        case DEVICE_DEPTH_EQUAL: return z == stored;
+        case DEVICE_DEPTH_LEQUAL: return z >= stored;
+        case DEVICE_DEPTH_GREATER: return z < stored;
+        case DEVICE_DEPTH_NOTEQUAL: return z != stored;
+        case DEVICE_DEPTH_GEQUAL: return z <= stored;
+        default: return 1;
+    }
+}
+
+// fragments behind every stored depth can only fail these funcs
+static int hiz_can_reject(int func) {
+    return func == DEVICE_DEPTH_LESS || func == DEVICE_DEPTH_LEQUAL || func == DEVICE_DEPTH_EQUAL || func == DEVICE_DEPTH_NEVER;
+}
+
+// slack for interpolated depth landing a few ulps past the vertex values
+#define HIZ_SLACK 1.00001f
+
+// 1 when the nearest point of the triangle is behind everything drawn in its bounds inside clip
+static int hiz_triangle_hidden(device_t* device, const rect_t* clip, const raster_vertex_t* tri) {
+    float near = MAX(MAX(tri[0].v[0], tri[1].v[0]), tri[2].v[0]) * HIZ_SLACK;
+    
+    int minx = (int)floorf(MIN(MIN(tri[0].x, tri[1].x), tri[2].x)) - 1;
+    int maxx = (int)ceilf(MAX(MAX(tri[0].x, tri[1].x), tri[2].x)) + 1;
+    int miny = (int)floorf(MIN(MIN(tri[0].y, tri[1].y), tri[2].y)) - 1;
+    int maxy = (int)ceilf(MAX(MAX(tri[0].y, tri[1].y), tri[2].y)) + 1;
+    minx = MAX(minx, clip->x0);
+    miny = MAX(miny, clip->y0);
+    maxx = MIN(maxx, clip->x1 - 1);
+    maxy = MIN(maxy, clip->y1 - 1);
+    if (minx > maxx || miny > maxy) return 1;
+    
+    int bx0 = minx / BLOCK_SIZE, bx1 = maxx / BLOCK_SIZE;
+    int by0 = miny / BLOCK_SIZE, by1 = maxy / BLOCK_SIZE;
+    const int n = DEVICE_TILE_SIZE / BLOCK_SIZE;
+    
+    for (int ty = by0 / n; ty <= by1 / n; ty++) {
+        for (int tx = bx0 / n; tx <= bx1 / n; tx++) {
+            int x0 = MAX(bx0, tx * n), x1 = MIN(bx1, tx * n + n - 1);
+            int y0 = MAX(by0, ty * n), y1 = MIN(by1, ty * n + n - 1);
             
-            if (device->lighting) {
+            // large footprints try the whole tile first
+            if ((x1 - x0 + 1) * (y1 - y0 + 1) > 4 && near < hiz_tile_far(device, tx, ty)) continue;
+            
+            for (int by = y0; by <= y1; by++) {
+                for (int bx = x0; bx <= x1; bx++) {
+                    if (near >= hiz_block_far(device, bx, by)) return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// shade pixels x0 .. x1 - 1 of row y, the varyings at x are origin + ddx * (x - ox) and those of the
+// rows around it move by ddy per row. shade, lighting, texture, colors and the texture filter and
+// wrap mode are constants in every span_* instance below, so each one is compiled with only its
+// own path and sampler left in the loop
+static inline __attribute__((always_inline))
+void span_shade(device_t* device, int y, int x0, int x1, const float* origin, const float* ddx, const float* ddy, int ox, int ztest,
+                const int shade, const int lighting, const int texture, const int colors, const int filter, const int wrap) {
+    static const float zero[4] = {0, 0, 0, 0};
+    const varyings_t* varyings = &device->varyings;
+    const int func = device->depth_func;
+    const int depth_write = device->depth_write;
+    const float* c0 = origin + varyings->color;
+    const float* cd = ddx + varyings->color;
+    const float* n0 = varyings->normal ? origin + varyings->normal : zero;
+    const float* nd = varyings->normal ? ddx + varyings->normal : zero;
+    const float* t0 = varyings->texcoord ? origin + varyings->texcoord : zero;
+    const float* td = varyings->texcoord ? ddx + varyings->texcoord : zero;
+    float* zbuffer = device->zbuffer + y * device->width;
+    uint32_t* framebuffer = device->framebuffer + y * device->width;
+    const texture_t* tex = device->texture;
+    const int mipmap = (filter == DEVICE_TEXTURE_NEAREST_MIPMAP || filter == DEVICE_TEXTURE_TRILINEAR) && varyings->texcoord;
+    int quad = -1;
+    float lod = 0;
+    // DEVICE_TEXTURE_BILINEAR samples pixels batch .. batch + 3 together
+    uint32_t texels[4];
+    int batch = x0 - 4;
+    
+    for (int x = x0; x < x1; x++) {
+        float n = (float)(x - ox);
+        float oneoverz = origin[0] + ddx[0] * n;
+        if (ztest && !depth_test(func, zbuffer[x], oneoverz)) continue;
+        
+        if (shade) {
+            float z = 1 / oneoverz;
+            float color[4] = {1, 1, 1, 1};
+            if (colors) {
+                color[0] = (c0[0] + cd[0] * n) * z;
+                color[1] = (c0[1] + cd[1] * n) * z;
+                color[2] = (c0[2] + cd[2] * n) * z;
+                color[3] = (c0[3] + cd[3] * n) * z;
+            }
+            if (lighting) {
+                float normal[4] = {n0[0] + nd[0] * n, n0[1] + nd[1] * n, n0[2] + nd[2] * n, 0};
                 process_lighting(device, normal, color);
             }
             
             uint32_t rgba;
-            if (device->texture) {
-                color_t c = device_texture_read(device, v->texcoord[0] * z, v->texcoord[1] * z);
-                if (device->lighting) {
+            if (texture) {
+                float u = (t0[0] + td[0] * n) * z, v = (t0[1] + td[1] * n) * z;
+                uint32_t texel;
+                if (filter == DEVICE_TEXTURE_NEAREST) {
+                    texel = texture_nearest(tex, 0, wrap, u, v);
+                }
+                else if (filter == DEVICE_TEXTURE_BILINEAR) {
+                    if (x - batch >= 4) {
+                        // the same arithmetic as u and v above, pixels past x1 are sampled and dropped
+                        float bu[4], bv[4];
+                        for (int i = 0; i < 4; i++) {
+                            float m = n + i;
+                            float bz = 1 / (origin[0] + ddx[0] * m);
+                            bu[i] = (t0[0] + td[0] * m) * bz;
+                            bv[i] = (t0[1] + td[1] * m) * bz;
+                        }
+                        texture_bilinear4(tex, wrap, bu, bv, texels);
+                        batch = x;
+                    }
+                    texel = texels[x - batch];
+                }
+                else {
+                    if (mipmap && (x >> 1) != quad) {
+                        quad = x >> 1;
+                        lod = quad_lod(tex, wrap, origin, ddx, ddy, varyings->texcoord, (float)((x & ~1) - ox), (float)((y & ~1) - y));
+                    }
+                    texel = texture_sample(tex, filter, wrap, lod, u, v);
+                }
+                color_t c;
+                memcpy(&c, &texel, sizeof(c));
+                if (lighting) {
                     int t;
                     t = ROUND(c.r * color[0]);
                     c.r = CLAMP(t, 0, 255);
@@ -844,77 +1853,552 @@ static void draw_scanline(device_t* device, scanline_t* scanline) {
                     t = ROUND(c.a * color[3]);
                     c.a = CLAMP(t, 0, 255);
                 }
-                rgba = *(uint32_t*)(&c);
+                memcpy(&rgba, &c, sizeof(rgba));
             }
             else {
                 rgba = rgba_float_to_uint(color[0], color[1], color[2], color[3]);
             }
-            
-            device->framebuffer[index] = rgba;
-            device->zbuffer[index] = v->oneoverz;
+            framebuffer[x] = rgba;
         }
         
-        vertex_add(v, &scanline->step);
+        if (depth_write) {
+            zbuffer[x] = oneoverz;
+            hiz_write(device, x, y, oneoverz);
+        }
     }
 }
 
-static void fill_bottom_flat_triangle(device_t* device, vertex_t* v1, vertex_t* v2, vertex_t* v3) {
-    int t = MIN(CEIL(v1->position[1]), device->height);
-    int b = MAX(CEIL(v3->position[1]), 0);
+#define SPAN_KERNEL_TARGET(name, target, shade, lighting, texture, colors, filter, wrap) \
+    target static void name(device_t* device, int y, int x0, int x1, const float* origin, const float* ddx, const float* ddy, int ox, int ztest) { \
+        span_shade(device, y, x0, x1, origin, ddx, ddy, ox, ztest, shade, lighting, texture, colors, filter, wrap); \
+    }
+
+// every kernel once per kernels_t, the same source compiled for each instruction set
+#if defined(DEVICE_DISPATCH)
+#define SPAN_KERNEL(name, shade, lighting, texture, colors, filter, wrap) \
+    SPAN_KERNEL_TARGET(name, , shade, lighting, texture, colors, filter, wrap) \
+    SPAN_KERNEL_TARGET(name##_sse42, TARGET_SSE42, shade, lighting, texture, colors, filter, wrap) \
+    SPAN_KERNEL_TARGET(name##_avx2, TARGET_AVX2, shade, lighting, texture, colors, filter, wrap)
+#else
+#define SPAN_KERNEL(name, shade, lighting, texture, colors, filter, wrap) \
+    SPAN_KERNEL_TARGET(name, , shade, lighting, texture, colors, filter, wrap)
+#endif
+
+SPAN_KERNEL(span_depth, 0, 0, 0, 0, 0, 0)
+SPAN_KERNEL(span_flat, 1, 0, 0, 0, 0, 0)
+SPAN_KERNEL(span_color, 1, 0, 0, 1, 0, 0)
+SPAN_KERNEL(span_lit, 1, 1, 0, 0, 0, 0)
+SPAN_KERNEL(span_lit_color, 1, 1, 0, 1, 0, 0)
+
+// the four textured kernels of one sampler, a filter and wrap mode pair
+#define SPAN_TEXTURE_KERNELS(sampler, filter, wrap) \
+    SPAN_KERNEL(span_texture_##sampler, 1, 0, 1, 0, filter, wrap) \
+    SPAN_KERNEL(span_texture_color_##sampler, 1, 0, 1, 1, filter, wrap) \
+    SPAN_KERNEL(span_lit_texture_##sampler, 1, 1, 1, 0, filter, wrap) \
+    SPAN_KERNEL(span_lit_texture_color_##sampler, 1, 1, 1, 1, filter, wrap)
+
+SPAN_TEXTURE_KERNELS(nearest_clamp, DEVICE_TEXTURE_NEAREST, DEVICE_TEXTURE_CLAMP)
+SPAN_TEXTURE_KERNELS(nearest_repeat, DEVICE_TEXTURE_NEAREST, DEVICE_TEXTURE_REPEAT)
+SPAN_TEXTURE_KERNELS(nearest_mipmap_clamp, DEVICE_TEXTURE_NEAREST_MIPMAP, DEVICE_TEXTURE_CLAMP)
+SPAN_TEXTURE_KERNELS(nearest_mipmap_repeat, DEVICE_TEXTURE_NEAREST_MIPMAP, DEVICE_TEXTURE_REPEAT)
+SPAN_TEXTURE_KERNELS(trilinear_clamp, DEVICE_TEXTURE_TRILINEAR, DEVICE_TEXTURE_CLAMP)
+SPAN_TEXTURE_KERNELS(trilinear_repeat, DEVICE_TEXTURE_TRILINEAR, DEVICE_TEXTURE_REPEAT)
+SPAN_TEXTURE_KERNELS(bilinear_clamp, DEVICE_TEXTURE_BILINEAR, DEVICE_TEXTURE_CLAMP)
+SPAN_TEXTURE_KERNELS(bilinear_repeat, DEVICE_TEXTURE_BILINEAR, DEVICE_TEXTURE_REPEAT)
+
+// kernels_t.span of one instruction set, indexed by span_kernel_index: the untextured kernels,
+// then the textured ones of each sampler in the order of filter * 2 + wrap
+#define SPAN_TEXTURE_KERNEL_NAMES(sampler, suffix) \
+    span_texture_##sampler##suffix, span_texture_color_##sampler##suffix, \
+    span_lit_texture_##sampler##suffix, span_lit_texture_color_##sampler##suffix,
+
+#define SPAN_KERNELS(suffix) { \
+    span_depth##suffix, \
+    span_flat##suffix, span_color##suffix, span_lit##suffix, span_lit_color##suffix, \
+    SPAN_TEXTURE_KERNEL_NAMES(nearest_clamp, suffix) \
+    SPAN_TEXTURE_KERNEL_NAMES(nearest_repeat, suffix) \
+    SPAN_TEXTURE_KERNEL_NAMES(nearest_mipmap_clamp, suffix) \
+    SPAN_TEXTURE_KERNEL_NAMES(nearest_mipmap_repeat, suffix) \
+    SPAN_TEXTURE_KERNEL_NAMES(trilinear_clamp, suffix) \
+    SPAN_TEXTURE_KERNEL_NAMES(trilinear_repeat, suffix) \
+    SPAN_TEXTURE_KERNEL_NAMES(bilinear_clamp, suffix) \
+    SPAN_TEXTURE_KERNEL_NAMES(bilinear_repeat, suffix) \
+}
+
+static int span_kernel_index(const device_t* device) {
+    if (!device->color_write) return 0;
+    int kernel = (device->lighting != 0) << 1 | (device->varyings.color != 0);
+    if (!device->texture) return 1 + kernel;
+    // filters the device does not know sample like DEVICE_TEXTURE_NEAREST
+    int filter = device->texture_filter;
+    if (filter < DEVICE_TEXTURE_NEAREST || filter > DEVICE_TEXTURE_BILINEAR) filter = DEVICE_TEXTURE_NEAREST;
+    int sampler = filter * 2 + (device->texture_wrap == DEVICE_TEXTURE_REPEAT);
+    return 5 + sampler * 4 + kernel;
+}
+
+// ddy is the row to row gradient of the varyings over the whole triangle
+static void draw_scanline(device_t* device, const rect_t* clip, const scanline_t* scanline, const float* ddy) {
+    int left = MAX(scanline->x, clip->x0);
+    int right = MIN(scanline->x + scanline->w, clip->x1);
+    // evaluated from the span start instead of accumulated, so a span cut by a tile edge
+    // produces exactly the same values as the whole span
+    device->kernels->span[device->span_kernel](device, scanline->y, left, right, scanline->v, scanline->step, ddy, scanline->x, 1);
+}
+
+// the row is interpolated on both edges, so only the x of the end points matters
+static void scanline_edges(raster_vertex_t* l, raster_vertex_t* r, const raster_vertex_t* a, const raster_vertex_t* b,
+                           const raster_vertex_t* c, const raster_vertex_t* d, float t, int n) {
+    l->x = interp(a->x, b->x, t);
+    r->x = interp(c->x, d->x, t);
+    varying_lerp(l->v, a->v, b->v, t, n);
+    varying_lerp(r->v, c->v, d->v, t, n);
+}
+
+static void fill_bottom_flat_triangle(device_t* device, const rect_t* clip, const raster_vertex_t* v1, const raster_vertex_t* v2, const raster_vertex_t* v3,
+                                      const float* ddy) {
+    int t = MIN(CEIL(v1->y), clip->y1 - 1);
+    int b = MAX(CEIL(v3->y), clip->y0);
+    int n = device->varyings.count;
     
     scanline_t scanline;
-    vertex_t vl, vr;
-    float height = v1->position[1] - v2->position[1];
+    raster_vertex_t vl, vr;
+    float height = v1->y - v2->y;
     
     for (int scanlineY = t; scanlineY >= b; scanlineY--) {
-        float t = (v1->position[1] - scanlineY) / height;
-        vertex_interp(&vl, v1, v2, t);
-        vertex_interp(&vr, v1, v3, t);
+        float t = (v1->y - scanlineY) / height;
+        scanline_edges(&vl, &vr, v1, v2, v1, v3, t, n);
         
-        scanline_init(&scanline, vl.position[0] > vr.position[0] ? &vr : &vl, vl.position[0] > vr.position[0] ? &vl : &vr, scanlineY);
+        scanline_init(&scanline, vl.x > vr.x ? &vr : &vl, vl.x > vr.x ? &vl : &vr, scanlineY, n);
         
-        draw_scanline(device, &scanline);
+        draw_scanline(device, clip, &scanline, ddy);
     }
 }
 
-static void fill_top_flat_triangle(device_t* device, vertex_t* v1, vertex_t* v2, vertex_t* v3) {
-    int t = MIN(CEIL(v2->position[1]), device->height);
-    int b = MAX(CEIL(v3->position[1]), 0);
+static void fill_top_flat_triangle(device_t* device, const rect_t* clip, const raster_vertex_t* v1, const raster_vertex_t* v2, const raster_vertex_t* v3,
+                                   const float* ddy) {
+    int t = MIN(CEIL(v2->y), clip->y1);
+    int b = MAX(CEIL(v3->y), clip->y0);
+    int n = device->varyings.count;
     
     scanline_t scanline;
-    vertex_t vl, vr;
-    float height = v2->position[1] - v3->position[1];
+    raster_vertex_t vl, vr;
+    float height = v2->y - v3->y;
     
     for (int scanlineY = b; scanlineY < t; scanlineY++) {
-        float t = (scanlineY - v3->position[1]) / height;
-        vertex_interp(&vl, v3, v1, t);
-        vertex_interp(&vr, v3, v2, t);
+        float t = (scanlineY - v3->y) / height;
+        scanline_edges(&vl, &vr, v3, v1, v3, v2, t, n);
         
-        scanline_init(&scanline, vl.position[0] > vr.position[0] ? &vr : &vl, vl.position[0] > vr.position[0] ? &vl : &vr, scanlineY);
+        scanline_init(&scanline, vl.x > vr.x ? &vr : &vl, vl.x > vr.x ? &vl : &vr, scanlineY, n);
         
-        draw_scanline(device, &scanline);
+        draw_scanline(device, clip, &scanline, ddy);
     }
 }
 
-void draw_triangle(device_t* device, vertex_t* v1, vertex_t* v2, vertex_t* v3) {
-    transform_apply(&device->transform, v1->position);
-    transform_apply(&device->transform, v2->position);
-    transform_apply(&device->transform, v3->position);
+//===================================================================
+//half-space rasterizer
+//===================================================================
+
+// e(x, y) = a * x + b * y + c, positive inside
+typedef struct {
+    float a, b, c;
+} edge_t;
+
+static void edge_init(edge_t* e, const float* p1, const float* p2) {
+    e->a = p1[1] - p2[1];
+    e->b = p2[0] - p1[0];
+    e->c = p1[0] * p2[1] - p1[1] * p2[0];
+}
+
+// bit i is set when pixel i of an 8 pixel row is inside all edges, e holds the edge values at pixel 0
+static int coverage_mask8(const float* e, const edge_t* edges) {
+#if defined(__AVX__)
+    const __m256 ramp = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 e0 = _mm256_add_ps(_mm256_set1_ps(e[0]), _mm256_mul_ps(_mm256_set1_ps(edges[0].a), ramp));
+    __m256 e1 = _mm256_add_ps(_mm256_set1_ps(e[1]), _mm256_mul_ps(_mm256_set1_ps(edges[1].a), ramp));
+    __m256 e2 = _mm256_add_ps(_mm256_set1_ps(e[2]), _mm256_mul_ps(_mm256_set1_ps(edges[2].a), ramp));
+    __m256 in = _mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ), _mm256_cmp_ps(e1, zero, _CMP_GE_OQ));
+    in = _mm256_and_ps(in, _mm256_cmp_ps(e2, zero, _CMP_GE_OQ));
+    return _mm256_movemask_ps(in);
+#elif defined(__SSE2__)
+    const __m128 ramp_lo = _mm_set_ps(3, 2, 1, 0);
+    const __m128 ramp_hi = _mm_set_ps(7, 6, 5, 4);
+    const __m128 zero = _mm_setzero_ps();
+    int mask = 0;
+    for (int half = 0; half < 2; half++) {
+        __m128 ramp = half ? ramp_hi : ramp_lo;
+        __m128 e0 = _mm_add_ps(_mm_set1_ps(e[0]), _mm_mul_ps(_mm_set1_ps(edges[0].a), ramp));
+        __m128 e1 = _mm_add_ps(_mm_set1_ps(e[1]), _mm_mul_ps(_mm_set1_ps(edges[1].a), ramp));
+        __m128 e2 = _mm_add_ps(_mm_set1_ps(e[2]), _mm_mul_ps(_mm_set1_ps(edges[2].a), ramp));
+        __m128 in = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero));
+        in = _mm_and_ps(in, _mm_cmpge_ps(e2, zero));
+        mask |= _mm_movemask_ps(in) << (half * 4);
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        float n = (float)i;
+        if (e[0] + edges[0].a * n >= 0 && e[1] + edges[1].a * n >= 0 && e[2] + edges[2].a * n >= 0) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+// attribute planes stored per packed varying, the value at pixel (x, y) is origin + ddx * x + ddy * y
+typedef struct {
+    int count;
+    float origin[VARYING_MAX];
+    float ddx[VARYING_MAX];
+    float ddy[VARYING_MAX];
+    float near, far;    // depth range of the triangle
+} planes_t;
+
+// k1x, k1y and k2x, k2y are the screen space gradients of the barycentric weights of v2 and v3
+static void planes_init(planes_t* p, int count, const raster_vertex_t* v1, const raster_vertex_t* v2, const raster_vertex_t* v3,
+                        float k1x, float k1y, float k2x, float k2y) {
+    float corner[VARYING_MAX];
+    p->count = count;
+    varying_gradient(p->ddx, v1->v, v2->v, v3->v, k1x, k2x, count);
+    varying_gradient(p->ddy, v1->v, v2->v, v3->v, k1y, k2y, count);
+    varying_step(corner, v1->v, p->ddx, 0.5f - v1->x, count);
+    varying_step(p->origin, corner, p->ddy, 0.5f - v1->y, count);
+    p->near = MAX(MAX(v1->v[0], v2->v[0]), v3->v[0]);
+    p->far = MIN(MIN(v1->v[0], v2->v[0]), v3->v[0]);
+}
+
+// bounds of the triangle inside clip with the origin moved down to the block grid, 0 when empty
+static int block_bounds(const rect_t* clip, const raster_vertex_t* v1, const raster_vertex_t* v2, const raster_vertex_t* v3, rect_t* bounds) {
+    int minx = (int)floorf(MIN(MIN(v1->x, v2->x), v3->x));
+    int maxx = (int)ceilf(MAX(MAX(v1->x, v2->x), v3->x));
+    int miny = (int)floorf(MIN(MIN(v1->y, v2->y), v3->y));
+    int maxy = (int)ceilf(MAX(MAX(v1->y, v2->y), v3->y));
+    minx = MAX(minx, clip->x0);
+    miny = MAX(miny, clip->y0);
+    maxx = MIN(maxx, clip->x1 - 1);
+    maxy = MIN(maxy, clip->y1 - 1);
+    if (minx > maxx || miny > maxy) return 0;
+    
+    // blocks are aligned to the screen so tiles never share one
+    bounds->x0 = minx & ~(BLOCK_SIZE - 1);
+    bounds->y0 = miny & ~(BLOCK_SIZE - 1);
+    bounds->x1 = maxx + 1;
+    bounds->y1 = maxy + 1;
+    return 1;
+}
+
+// coarse depth test of the triangle over the block at pixel bx, by, returns 0 when the block is hidden,
+// *ztest is 0 when every fragment of the block is known to pass
+static int block_depth(device_t* device, const planes_t* p, int bx, int by, int* ztest) {
+    const float span = BLOCK_SIZE - 1;
+    const hiz_t* hiz = &device->hiz;
+    float dzdx = p->ddx[0] * span, dzdy = p->ddy[0] * span;
+    float z = p->origin[0] + p->ddx[0] * bx + p->ddy[0] * by;
+    float near = MIN(z + MAX(dzdx, 0) + MAX(dzdy, 0), p->near);
+    float far = MAX(z + MIN(dzdx, 0) + MIN(dzdy, 0), p->far);
+    
+    if (hiz_can_reject(device->depth_func) && near * HIZ_SLACK < hiz_block_far(device, bx / BLOCK_SIZE, by / BLOCK_SIZE)) {
+        return 0;
+    }
     
-    if (check_cvv(v1->position) && check_cvv(v2->position) && check_cvv(v3->position)) {
-        return;
+    *ztest = 1;
+    if (device->depth_func == DEVICE_DEPTH_ALWAYS) {
+        *ztest = 0;
+    }
+    else if (device->depth_func == DEVICE_DEPTH_LESS || device->depth_func == DEVICE_DEPTH_LEQUAL) {
+        *ztest = far <= hiz->block_near[(by / BLOCK_SIZE) * hiz->width + bx / BLOCK_SIZE] * HIZ_SLACK;
+    }
+    return 1;
+}
+
+// the part of the block at bx, by inside clip, returns the matching row mask
+static int block_clip(const rect_t* clip, int bx, int by, rect_t* out) {
+    out->x0 = MAX(bx, clip->x0);
+    out->x1 = MIN(bx + BLOCK_SIZE, clip->x1);
+    out->y0 = MAX(by, clip->y0);
+    out->y1 = MIN(by + BLOCK_SIZE, clip->y1);
+    return ((1 << (out->x1 - bx)) - 1) & ~((1 << (out->x0 - bx)) - 1);
+}
+
+// shade the pixels of one block row selected by mask, x is the first pixel of the row,
+// ztest is 0 when the block is known to be in front of everything drawn so far
+static void draw_block_row(device_t* device, const planes_t* p, int mask, int x, int y, int ztest) {
+    float row[VARYING_MAX];
+    varying_step(row, p->origin, p->ddy, (float)y, p->count);
+    span_kernel_t kernel = device->kernels->span[device->span_kernel];
+    // one run of covered pixels for a triangle, the loop only guards against odd masks
+    while (mask) {
+        for (; !(mask & 1); mask >>= 1) x++;
+        int start = x;
+        for (; mask & 1; mask >>= 1) x++;
+        kernel(device, y, start, x, row, p->ddx, p->ddy, 0, ztest);
+    }
+}
+
+static void fill_triangle_halfspace(device_t* device, const rect_t* clip, const raster_vertex_t* v1, const raster_vertex_t* v2, const raster_vertex_t* v3) {
+    edge_t edges[3];
+    edge_init(&edges[0], &v2->x, &v3->x);
+    edge_init(&edges[1], &v3->x, &v1->x);
+    edge_init(&edges[2], &v1->x, &v2->x);
+    
+    float area = edges[2].a * v3->x + edges[2].b * v3->y + edges[2].c;
+    if (area == 0) return;
+    if (area < 0) {
+        for (int i = 0; i < 3; i++) {
+            edges[i].a = -edges[i].a;
+            edges[i].b = -edges[i].b;
+            edges[i].c = -edges[i].c;
+        }
+        area = -area;
+    }
+    
+    // barycentric weights of v2 and v3 are edges[1] / area and edges[2] / area
+    planes_t planes;
+    float inv = 1 / area;
+    planes_init(&planes, device->varyings.count, v1, v2, v3, edges[1].a * inv, edges[1].b * inv, edges[2].a * inv, edges[2].b * inv);
+    
+    // pixel centers are sampled, so move the edges by half a pixel once
+    for (int i = 0; i < 3; i++) {
+        edges[i].c += (edges[i].a + edges[i].b) * 0.5f;
+    }
+    
+    rect_t bounds;
+    if (!block_bounds(clip, v1, v2, v3, &bounds)) return;
+    
+    const float span = BLOCK_SIZE - 1;
+    for (int by = bounds.y0; by < bounds.y1; by += BLOCK_SIZE) {
+        for (int bx = bounds.x0; bx < bounds.x1; bx += BLOCK_SIZE) {
+            float e[3];
+            int reject = 0, accept = 1;
+            for (int i = 0; i < 3; i++) {
+                const edge_t* edge = &edges[i];
+                e[i] = edge->a * bx + edge->b * by + edge->c;
+                float lo = e[i] + MIN(edge->a, 0) * span + MIN(edge->b, 0) * span;
+                float hi = e[i] + MAX(edge->a, 0) * span + MAX(edge->b, 0) * span;
+                if (hi < 0) reject = 1;
+                if (lo < 0) accept = 0;
+            }
+            
+            int ztest;
+            if (reject || !block_depth(device, &planes, bx, by, &ztest)) continue;
+            
+            rect_t block;
+            int clip_mask = block_clip(clip, bx, by, &block);
+            
+            for (int y = block.y0; y < block.y1; y++) {
+                int mask = clip_mask;
+                if (!accept) {
+                    float row[3];
+                    for (int i = 0; i < 3; i++) {
+                        row[i] = e[i] + edges[i].b * (y - by);
+                    }
+                    mask &= coverage_mask8(row, edges);
+                }
+                if (mask) {
+                    draw_block_row(device, &planes, mask >> (block.x0 - bx), block.x0, y, ztest);
+                }
+            }
+        }
+    }
+}
+
+//===================================================================
+//fixed point rasterizer
+//===================================================================
+
+// e(X, Y) = a * X + b * Y + c in subpixel units, a pixel is covered when e + bias >= 0
+typedef struct {
+    int64_t a, b, c;
+    int64_t bias;
+} fixed_edge_t;
+
+static void fixed_edge_init(fixed_edge_t* e, const int64_t* p1, const int64_t* p2) {
+    e->a = p1[1] - p2[1];
+    e->b = p2[0] - p1[0];
+    e->c = p1[0] * p2[1] - p1[1] * p2[0];
+}
+
+// vertices are already snapped to the subpixel grid by cvv_to_view_port
+static void fill_triangle_fixed(device_t* device, const rect_t* clip, const raster_vertex_t* v1, const raster_vertex_t* v2, const raster_vertex_t* v3) {
+    const int bits = device->subpixel_bits;
+    const int64_t one = (int64_t)1 << bits;
+    int64_t p[3][2];
+    const raster_vertex_t* v[3] = {v1, v2, v3};
+    for (int i = 0; i < 3; i++) {
+        p[i][0] = (int64_t)lrintf(v[i]->x * one);
+        p[i][1] = (int64_t)lrintf(v[i]->y * one);
+    }
+    
+    fixed_edge_t edges[3];
+    fixed_edge_init(&edges[0], p[1], p[2]);
+    fixed_edge_init(&edges[1], p[2], p[0]);
+    fixed_edge_init(&edges[2], p[0], p[1]);
+    
+    int64_t area = edges[2].a * p[2][0] + edges[2].b * p[2][1] + edges[2].c;
+    if (area == 0) return;
+    if (area < 0) {
+        for (int i = 0; i < 3; i++) {
+            edges[i].a = -edges[i].a;
+            edges[i].b = -edges[i].b;
+            edges[i].c = -edges[i].c;
+        }
+        area = -area;
     }
     
-    float normal[4];
-    float vec12[4];
-    float vec13[4];
-    vec4_sub(vec12, v1->position, v2->position);
-    vec4_sub(vec13, v1->position, v3->position);
-    vec4_cross(normal, vec12, vec13);
-    if (normal[2] < 0) {
+    // top-left rule: a pixel center exactly on an edge belongs to the triangle only if the
+    // edge is a left edge, or a horizontal edge with the inside above it
+    for (int i = 0; i < 3; i++) {
+        edges[i].bias = (edges[i].a > 0 || (edges[i].a == 0 && edges[i].b > 0)) ? 0 : -1;
+    }
+    
+    // the only division of the setup, one pixel is `one` subpixels
+    planes_t planes;
+    float inv = (float)one / (float)area;
+    planes_init(&planes, device->varyings.count, v1, v2, v3, edges[1].a * inv, edges[1].b * inv, edges[2].a * inv, edges[2].b * inv);
+    
+    rect_t bounds;
+    if (!block_bounds(clip, v1, v2, v3, &bounds)) return;
+    
+    const int64_t half = one >> 1;
+    const int64_t span = (BLOCK_SIZE - 1) * one;
+    for (int by = bounds.y0; by < bounds.y1; by += BLOCK_SIZE) {
+        for (int bx = bounds.x0; bx < bounds.x1; bx += BLOCK_SIZE) {
+            int64_t e[3];
+            int reject = 0, accept = 1;
+            for (int i = 0; i < 3; i++) {
+                const fixed_edge_t* edge = &edges[i];
+                e[i] = edge->a * (bx * one + half) + edge->b * (by * one + half) + edge->c + edge->bias;
+                int64_t lo = e[i] + MIN(edge->a, 0) * span + MIN(edge->b, 0) * span;
+                int64_t hi = e[i] + MAX(edge->a, 0) * span + MAX(edge->b, 0) * span;
+                if (hi < 0) reject = 1;
+                if (lo < 0) accept = 0;
+            }
+            
+            int ztest;
+            if (reject || !block_depth(device, &planes, bx, by, &ztest)) continue;
+            
+            rect_t block;
+            int clip_mask = block_clip(clip, bx, by, &block);
+            
+            for (int y = block.y0; y < block.y1; y++) {
+                int mask = clip_mask;
+                if (!accept) {
+                    int64_t e0 = e[0] + edges[0].b * one * (y - by);
+                    int64_t e1 = e[1] + edges[1].b * one * (y - by);
+                    int64_t e2 = e[2] + edges[2].b * one * (y - by);
+                    int64_t s0 = edges[0].a * one, s1 = edges[1].a * one, s2 = edges[2].a * one;
+                    int coverage = 0;
+                    for (int i = 0; i < BLOCK_SIZE; i++, e0 += s0, e1 += s1, e2 += s2) {
+                        if ((e0 | e1 | e2) >= 0) coverage |= 1 << i;
+                    }
+                    mask &= coverage;
+                }
+                if (mask) {
+                    draw_block_row(device, &planes, mask >> (block.x0 - bx), block.x0, y, ztest);
+                }
+            }
+        }
+    }
+}
+
+// gradient of the varyings along y, the planes_t ddy of the triangle
+static void triangle_ddy(float* ddy, int count, const raster_vertex_t* v1, const raster_vertex_t* v2, const raster_vertex_t* v3) {
+    edge_t e1, e2;
+    edge_init(&e1, &v3->x, &v1->x);
+    edge_init(&e2, &v1->x, &v2->x);
+    float area = e2.a * v3->x + e2.b * v3->y + e2.c;
+    if (area == 0) {
+        memset(ddy, 0, count * sizeof(float));
         return;
     }
+    varying_gradient(ddy, v1->v, v2->v, v3->v, e1.b / area, e2.b / area, count);
+}
+
+// rasterize a set up triangle, touching only pixels inside clip
+static void triangle_raster(device_t* device, const rect_t* clip, const raster_vertex_t* tri) {
+    const raster_vertex_t* v1 = &tri[0];
+    const raster_vertex_t* v2 = &tri[1];
+    const raster_vertex_t* v3 = &tri[2];
+    int fill = (device->draw_mode & DEVICE_DRAW_MODE_NORMAL);
+    if (fill && hiz_can_reject(device->depth_func)) {
+        fill = !hiz_triangle_hidden(device, clip, tri);
+    }
     
+    if (fill && device->raster_mode == DEVICE_RASTER_HALFSPACE) {
+        fill_triangle_halfspace(device, clip, v1, v2, v3);
+    }
+    else if (fill && device->raster_mode == DEVICE_RASTER_FIXED) {
+        fill_triangle_fixed(device, clip, v1, v2, v3);
+    }
+    else if (fill) {
+        const raster_vertex_t* top;
+        const raster_vertex_t* middle;
+        const raster_vertex_t* bottom;
+        sort_vertices_by_y(v1, v2, v3, &top, &middle, &bottom);
+        // the spans only step along x, the mipmapped samplers also need the gradient along y
+        float ddy[VARYING_MAX];
+        triangle_ddy(ddy, device->varyings.count, v1, v2, v3);
+        
+        if (EQUAL(middle->y, bottom->y)) {
+            fill_bottom_flat_triangle(device, clip, top, middle, bottom, ddy);
+        }
+        else if (EQUAL(middle->y, top->y)) {
+            fill_top_flat_triangle(device, clip, top, middle, bottom, ddy);
+        }
+        else {
+            raster_vertex_t v4;
+            float t = (top->y - middle->y) / (top->y - bottom->y);
+            v4.x = interp(top->x, bottom->x, t);
+            v4.y = middle->y;
+            varying_lerp(v4.v, top->v, bottom->v, t, device->varyings.count);
+            fill_bottom_flat_triangle(device, clip, top, middle, &v4, ddy);
+            fill_top_flat_triangle(device, clip, middle, &v4, bottom, ddy);
+        }
+    }
+    
+    if ((device->draw_mode & DEVICE_DRAW_MODE_WILD) && device->color_write) {
+        draw_line_clipped(device, clip, CEIL(v1->x), CEIL(v1->y), CEIL(v2->x), CEIL(v2->y), 0xffffffff);
+        draw_line_clipped(device, clip, CEIL(v2->x), CEIL(v2->y), CEIL(v3->x), CEIL(v3->y), 0xffffffff);
+        draw_line_clipped(device, clip, CEIL(v3->x), CEIL(v3->y), CEIL(v1->x), CEIL(v1->y), 0xffffffff);
+    }
+}
+
+// keep only the varyings of the draw
+static void raster_vertex_pack(const varyings_t* varyings, const vertex_t* in, raster_vertex_t* out) {
+    out->x = in->position[0];
+    out->y = in->position[1];
+    out->v[0] = in->oneoverz;
+    if (varyings->color) {
+        float* c = out->v + varyings->color;
+        c[0] = in->color[0], c[1] = in->color[1], c[2] = in->color[2], c[3] = in->color[3];
+    }
+    if (varyings->normal) {
+        float* n = out->v + varyings->normal;
+        n[0] = in->normal[0], n[1] = in->normal[1], n[2] = in->normal[2];
+    }
+    if (varyings->texcoord) {
+        float* t = out->v + varyings->texcoord;
+        t[0] = in->texcoord[0], t[1] = in->texcoord[1];
+    }
+}
+
+// bin the triangle for the tile workers or rasterize it right away
+static void triangle_submit(device_t* device, int bin, const raster_vertex_t* tri) {
+    if (bin) {
+        tiler_bin(device, tri);
+    }
+    else {
+        rect_t rect;
+        device_rect(device, &rect);
+        triangle_raster(device, &rect, tri);
+    }
+}
+
+// perspective division and view port mapping of a triangle inside the guard band, then
+// either bin it for the tiler or rasterize it right away
+static void triangle_emit(device_t* device, int bin, vertex_t* v1, vertex_t* v2, vertex_t* v3) {
     vertex_pre_process(v1);
     vertex_pre_process(v2);
     vertex_pre_process(v3);
@@ -923,184 +2407,1049 @@ void draw_triangle(device_t* device, vertex_t* v1, vertex_t* v2, vertex_t* v3) {
     perspective_division(v2->position);
     perspective_division(v3->position);
     
-    cvv_to_view_port(v1->position, device->width, device->height);
-    cvv_to_view_port(v2->position, device->width, device->height);
-    cvv_to_view_port(v3->position, device->width, device->height);
+    int subpixel_bits = device->raster_mode == DEVICE_RASTER_FIXED ? device->subpixel_bits : 0;
+    cvv_to_view_port(v1->position, device->width, device->height, subpixel_bits);
+    cvv_to_view_port(v2->position, device->width, device->height, subpixel_bits);
+    cvv_to_view_port(v3->position, device->width, device->height, subpixel_bits);
     
-    if (device->draw_mode & DEVICE_DRAW_MODE_NORMAL) {
-        vertex_t* top;
-        vertex_t* middle;
-        vertex_t* bottom;
-        sort_vertices_by_y(v1, v2, v3, &top, &middle, &bottom);
+    raster_vertex_t tri[3];
+    raster_vertex_pack(&device->varyings, v1, &tri[0]);
+    raster_vertex_pack(&device->varyings, v2, &tri[1]);
+    raster_vertex_pack(&device->varyings, v3, &tri[2]);
+    
+    triangle_submit(device, bin, tri);
+}
+
+// clip space stage: trivial reject, back face culling and clipping against the near and
+// far planes and the guard band, the result is emitted as a triangle fan
+// trivially outside one of the view planes or facing away
+static int triangle_culled(const float* p1, const float* p2, const float* p3, int c1, int c2, int c3) {
+    if (c1 & c2 & c3 & CLIP_VIEW) {
+        return 1;
+    }
+    
+    // orientation from the homogeneous determinant, valid even when w changes sign
+    float det = p1[0] * (p2[1] * p3[3] - p3[1] * p2[3])
+              - p1[1] * (p2[0] * p3[3] - p3[0] * p2[3])
+              + p1[3] * (p2[0] * p3[1] - p3[0] * p2[1]);
+    return det < 0;
+}
+
+// clip against the planes set in the outcodes and emit the result as a fan
+static void triangle_clip(device_t* device, int bin, int planes, vertex_t* v1, vertex_t* v2, vertex_t* v3) {
+    vertex_t buffer[2][CLIP_MAX_VERTICES];
+    vertex_t* polygon = buffer[0];
+    int count = 3;
+    polygon[0] = *v1;
+    polygon[1] = *v2;
+    polygon[2] = *v3;
+    
+    for (int plane = CLIP_NEAR; plane <= GUARD_TOP && count >= 3; plane <<= 1) {
+        if (planes & plane) {
+            vertex_t* out = polygon == buffer[0] ? buffer[1] : buffer[0];
+            count = clip_polygon(polygon, count, out, plane);
+            polygon = out;
+        }
+    }
+    
+    for (int i = 2; i < count; i++) {
+        vertex_t a = polygon[0], b = polygon[i - 1], c = polygon[i];
+        triangle_emit(device, bin, &a, &b, &c);
+    }
+}
+
+static void triangle_assemble(device_t* device, int bin, vertex_t* v1, vertex_t* v2, vertex_t* v3) {
+    int c1 = check_cvv(v1->position);
+    int c2 = check_cvv(v2->position);
+    int c3 = check_cvv(v3->position);
+    
+    if (triangle_culled(v1->position, v2->position, v3->position, c1, c2, c3)) {
+        return;
+    }
+    
+    int planes = (c1 | c2 | c3) & CLIP_GEOMETRY;
+    if (!planes) {
+        triangle_emit(device, bin, v1, v2, v3);
+    }
+    else {
+        triangle_clip(device, bin, planes, v1, v2, v3);
+    }
+}
+
+void draw_triangle(device_t* device, vertex_t* v1, vertex_t* v2, vertex_t* v3) {
+    draw_setup(device, VARYING_ALL);
+    
+    transform_apply(&device->transform, v1->position);
+    transform_apply(&device->transform, v2->position);
+    transform_apply(&device->transform, v3->position);
+    
+    triangle_assemble(device, 0, v1, v2, v3);
+}
+
+//===================================================================
+//vertex stage
+//===================================================================
+
+// one vertex of the bound arrays after transform, x, y and oneoverz are only meaningful when
+// codes has no CLIP_GEOMETRY bit, otherwise the triangle goes through the clipper from clip
+typedef struct post_vertex_s {
+    float clip[4];
+    float x, y;
+    float oneoverz;
+    int codes;
+} post_vertex_t;
+
+static post_vertex_t* post_buffer_reserve(device_t* device, int count) {
+    if (device->post_capacity < count) {
+        device->post_capacity = MAX(count, device->post_capacity * 2);
+        free(device->post);
+        free(device->post_stamp);
+        device->post = (post_vertex_t*)malloc(device->post_capacity * sizeof(post_vertex_t));
+        device->post_stamp = (unsigned*)calloc(device->post_capacity, sizeof(unsigned));
+        device->post_draw = 0;
+    }
+    return device->post;
+}
+
+// classify 0 when the whole draw is known to be inside the view volume, the outcodes are left 0
+static void post_vertex_scalar(const device_t* device, const float* m, const float* p, int subpixel_bits, int classify, post_vertex_t* out) {
+    float v[4] = {p[0], p[1], p[2], 1};
+    mat4_apply(out->clip, m, v);
+    out->codes = classify ? check_cvv(out->clip) : 0;
+    out->oneoverz = out->x = out->y = 0;
+    if (!(out->codes & CLIP_GEOMETRY)) {
+        v[0] = out->clip[0], v[1] = out->clip[1], v[2] = out->clip[2], v[3] = out->clip[3];
+        out->oneoverz = 1 / v[3];
+        perspective_division(v);
+        cvv_to_view_port(v, device->width, device->height, subpixel_bits);
+        out->x = v[0];
+        out->y = v[1];
+    }
+}
+
+// transform count float xyz positions at p by m into out: clip position, outcodes, 1/w and the
+// view port position. the SIMD variants do the arithmetic in the same order as mat4_apply,
+// check_cvv and cvv_to_view_port so every kernels_t gives the same bits
+static void vertex_block_scalar(device_t* device, const float* m, const float* p, int count, int classify, post_vertex_t* out) {
+    int subpixel_bits = device->raster_mode == DEVICE_RASTER_FIXED ? device->subpixel_bits : 0;
+    for (int i = 0; i < count; i++, p += 3) {
+        post_vertex_scalar(device, m, p, subpixel_bits, classify, &out[i]);
+    }
+}
+
+#if defined(DEVICE_DISPATCH)
+// four vertices per iteration
+TARGET_SSE42
+static void vertex_block_sse42(device_t* device, const float* m, const float* p, int count, int classify, post_vertex_t* out) {
+    int subpixel_bits = device->raster_mode == DEVICE_RASTER_FIXED ? device->subpixel_bits : 0;
+    int i = 0;
+    
+    const __m128 one = _mm_set1_ps(1), half = _mm_set1_ps(0.5f), guard = _mm_set1_ps(GUARD_BAND);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 width = _mm_set1_ps((float)device->width), height = _mm_set1_ps((float)device->height);
+    const __m128 snap = _mm_set1_ps((float)(1 << subpixel_bits));
+    const __m128i geometry = _mm_set1_epi32(CLIP_GEOMETRY);
+    
+    for (; i + 4 <= count; i += 4, p += 12) {
+        __m128 x = _mm_setr_ps(p[0], p[3], p[6], p[9]);
+        __m128 y = _mm_setr_ps(p[1], p[4], p[7], p[10]);
+        __m128 z = _mm_setr_ps(p[2], p[5], p[8], p[11]);
         
-        if (EQUAL(middle->position[1], bottom->position[1])) {
-            fill_bottom_flat_triangle(device, top, middle, bottom);
+        __m128 clip[4];
+        for (int k = 0; k < 4; k++) {
+            clip[k] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m[k])), _mm_mul_ps(y, _mm_set1_ps(m[4 + k]))),
+                                            _mm_mul_ps(z, _mm_set1_ps(m[8 + k]))), _mm_mul_ps(one, _mm_set1_ps(m[12 + k])));
         }
-        else if (EQUAL(middle->position[1], top->position[1])) {
-            fill_top_flat_triangle(device, top, middle, bottom);
+        
+        __m128 w = clip[3], nw = _mm_xor_ps(w, sign);
+        __m128 g = _mm_mul_ps(w, guard), ng = _mm_xor_ps(g, sign);
+        __m128i codes = _mm_setzero_si128();
+        if (classify) {
+#define POST_CODE(cmp, bit) codes = _mm_or_si128(codes, _mm_and_si128(_mm_castps_si128(cmp), _mm_set1_epi32(bit)))
+            POST_CODE(_mm_cmplt_ps(clip[0], nw), CLIP_LEFT);
+            POST_CODE(_mm_cmpgt_ps(clip[0], w), CLIP_RIGHT);
+            POST_CODE(_mm_cmplt_ps(clip[1], nw), CLIP_BOTTOM);
+            POST_CODE(_mm_cmpgt_ps(clip[1], w), CLIP_TOP);
+            POST_CODE(_mm_cmplt_ps(clip[2], nw), CLIP_NEAR);
+            POST_CODE(_mm_cmpgt_ps(clip[2], w), CLIP_FAR);
+            POST_CODE(_mm_cmplt_ps(clip[0], ng), GUARD_LEFT);
+            POST_CODE(_mm_cmpgt_ps(clip[0], g), GUARD_RIGHT);
+            POST_CODE(_mm_cmplt_ps(clip[1], ng), GUARD_BOTTOM);
+            POST_CODE(_mm_cmpgt_ps(clip[1], g), GUARD_TOP);
+#undef POST_CODE
+        }
+        
+        // lanes that need clipping may divide by zero, their results are masked out below
+        __m128 inv = _mm_div_ps(one, w);
+        __m128 sx = _mm_mul_ps(_mm_mul_ps(width, _mm_add_ps(_mm_mul_ps(clip[0], inv), one)), half);
+        __m128 sy = _mm_mul_ps(_mm_mul_ps(height, _mm_add_ps(_mm_mul_ps(clip[1], inv), one)), half);
+        if (subpixel_bits) {
+            sx = _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(sx, snap))), snap);
+            sy = _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(sy, snap))), snap);
         }
         else {
-            vertex_t v4;
-            vertex_interp(&v4, top, bottom, (top->position[1] - middle->position[1]) / (top->position[1] - bottom->position[1]));
-            fill_bottom_flat_triangle(device, top, middle, &v4);
-            fill_top_flat_triangle(device, middle, &v4, bottom);
+            sx = _mm_cvtepi32_ps(_mm_cvttps_epi32(sx));
+            sy = _mm_cvtepi32_ps(_mm_cvttps_epi32(sy));
         }
+        __m128 valid = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(codes, geometry), _mm_setzero_si128()));
+        sx = _mm_and_ps(sx, valid);
+        sy = _mm_and_ps(sy, valid);
+        inv = _mm_and_ps(inv, valid);
+        
+        __m128 c0 = clip[0], c1 = clip[1], c2 = clip[2], c3 = clip[3];
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+        __m128 s0 = sx, s1 = sy, s2 = inv, s3 = _mm_castsi128_ps(codes);
+        _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+        float* o = (float*)&out[i];
+        _mm_storeu_ps(o, c0), _mm_storeu_ps(o + 4, s0);
+        _mm_storeu_ps(o + 8, c1), _mm_storeu_ps(o + 12, s1);
+        _mm_storeu_ps(o + 16, c2), _mm_storeu_ps(o + 20, s2);
+        _mm_storeu_ps(o + 24, c3), _mm_storeu_ps(o + 28, s3);
     }
     
-    if (device->draw_mode & DEVICE_DRAW_MODE_WILD) {
-        draw_line(device, CEIL(v1->position[0]), CEIL(v1->position[1]), CEIL(v2->position[0]), CEIL(v2->position[1]), 0xffffffff);
-        draw_line(device, CEIL(v2->position[0]), CEIL(v2->position[1]), CEIL(v3->position[0]), CEIL(v3->position[1]), 0xffffffff);
-        draw_line(device, CEIL(v3->position[0]), CEIL(v3->position[1]), CEIL(v1->position[0]), CEIL(v1->position[1]), 0xffffffff);
+    for (; i < count; i++, p += 3) {
+        post_vertex_scalar(device, m, p, subpixel_bits, classify, &out[i]);
     }
 }
 
-void draw_arrays(device_t* device, int offset, int count) {
-    float * vp = device->vertex_pointer;
-    if (!vp || device->vertex_count < offset + count) return;
+// rows r[0 .. 7] become columns, lane j of every row ends up in r[j]
+TARGET_AVX2
+static inline void transpose8(__m256* r) {
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]), t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]), t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0] = _mm256_permute2f128_ps(s0, s4, 0x20), r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r[1] = _mm256_permute2f128_ps(s1, s5, 0x20), r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r[2] = _mm256_permute2f128_ps(s2, s6, 0x20), r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r[3] = _mm256_permute2f128_ps(s3, s7, 0x20), r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+// eight vertices per iteration, the eight fields of post_vertex_t come out of one 8x8 transpose
+TARGET_AVX2
+static void vertex_block_avx2(device_t* device, const float* m, const float* p, int count, int classify, post_vertex_t* out) {
+    int subpixel_bits = device->raster_mode == DEVICE_RASTER_FIXED ? device->subpixel_bits : 0;
+    int i = 0;
+    
+    const __m256 one = _mm256_set1_ps(1), half = _mm256_set1_ps(0.5f), guard = _mm256_set1_ps(GUARD_BAND);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 width = _mm256_set1_ps((float)device->width), height = _mm256_set1_ps((float)device->height);
+    const __m256 snap = _mm256_set1_ps((float)(1 << subpixel_bits));
+    const __m256i geometry = _mm256_set1_epi32(CLIP_GEOMETRY);
+    
+    for (; i + 8 <= count; i += 8, p += 24) {
+        __m256 x = _mm256_setr_ps(p[0], p[3], p[6], p[9], p[12], p[15], p[18], p[21]);
+        __m256 y = _mm256_setr_ps(p[1], p[4], p[7], p[10], p[13], p[16], p[19], p[22]);
+        __m256 z = _mm256_setr_ps(p[2], p[5], p[8], p[11], p[14], p[17], p[20], p[23]);
+        
+        __m256 r[8];
+        for (int k = 0; k < 4; k++) {
+            r[k] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(m[k])), _mm256_mul_ps(y, _mm256_set1_ps(m[4 + k]))),
+                                               _mm256_mul_ps(z, _mm256_set1_ps(m[8 + k]))), _mm256_mul_ps(one, _mm256_set1_ps(m[12 + k])));
+        }
+        
+        __m256 w = r[3], nw = _mm256_xor_ps(w, sign);
+        __m256 g = _mm256_mul_ps(w, guard), ng = _mm256_xor_ps(g, sign);
+        __m256i codes = _mm256_setzero_si256();
+        if (classify) {
+#define POST_CODE(cmp, bit) codes = _mm256_or_si256(codes, _mm256_and_si256(_mm256_castps_si256(cmp), _mm256_set1_epi32(bit)))
+            POST_CODE(_mm256_cmp_ps(r[0], nw, _CMP_LT_OS), CLIP_LEFT);
+            POST_CODE(_mm256_cmp_ps(r[0], w, _CMP_GT_OS), CLIP_RIGHT);
+            POST_CODE(_mm256_cmp_ps(r[1], nw, _CMP_LT_OS), CLIP_BOTTOM);
+            POST_CODE(_mm256_cmp_ps(r[1], w, _CMP_GT_OS), CLIP_TOP);
+            POST_CODE(_mm256_cmp_ps(r[2], nw, _CMP_LT_OS), CLIP_NEAR);
+            POST_CODE(_mm256_cmp_ps(r[2], w, _CMP_GT_OS), CLIP_FAR);
+            POST_CODE(_mm256_cmp_ps(r[0], ng, _CMP_LT_OS), GUARD_LEFT);
+            POST_CODE(_mm256_cmp_ps(r[0], g, _CMP_GT_OS), GUARD_RIGHT);
+            POST_CODE(_mm256_cmp_ps(r[1], ng, _CMP_LT_OS), GUARD_BOTTOM);
+            POST_CODE(_mm256_cmp_ps(r[1], g, _CMP_GT_OS), GUARD_TOP);
+#undef POST_CODE
+        }
+        
+        // lanes that need clipping may divide by zero, their results are masked out below
+        __m256 inv = _mm256_div_ps(one, w);
+        __m256 sx = _mm256_mul_ps(_mm256_mul_ps(width, _mm256_add_ps(_mm256_mul_ps(r[0], inv), one)), half);
+        __m256 sy = _mm256_mul_ps(_mm256_mul_ps(height, _mm256_add_ps(_mm256_mul_ps(r[1], inv), one)), half);
+        if (subpixel_bits) {
+            sx = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtps_epi32(_mm256_mul_ps(sx, snap))), snap);
+            sy = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtps_epi32(_mm256_mul_ps(sy, snap))), snap);
+        }
+        else {
+            sx = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(sx));
+            sy = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(sy));
+        }
+        __m256 valid = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(codes, geometry), _mm256_setzero_si256()));
+        r[4] = _mm256_and_ps(sx, valid);
+        r[5] = _mm256_and_ps(sy, valid);
+        r[6] = _mm256_and_ps(inv, valid);
+        r[7] = _mm256_castsi256_ps(codes);
+        
+        transpose8(r);
+        for (int k = 0; k < 8; k++) {
+            _mm256_storeu_ps((float*)&out[i + k], r[k]);
+        }
+    }
+    // the rest of the renderer is SSE code, which stalls on dirty upper halves until this
+    _mm256_zeroupper();
     
-    float * np = device->normal_pointer;
-    float * tp = device->texcoord_pointer;
-    float * cp = device->color_pointer;
+    for (; i < count; i++, p += 3) {
+        post_vertex_scalar(device, m, p, subpixel_bits, classify, &out[i]);
+    }
+}
+#endif
+
+static const kernels_t kernels_scalar = {SPAN_KERNELS(), vertex_block_scalar, clear_scalar};
+#if defined(DEVICE_DISPATCH)
+static const kernels_t kernels_sse42 = {SPAN_KERNELS(_sse42), vertex_block_sse42, clear_sse42};
+static const kernels_t kernels_avx2 = {SPAN_KERNELS(_avx2), vertex_block_avx2, clear_avx2};
+#endif
+
+// the best level this CPU runs
+static int simd_supported(void) {
+#if defined(DEVICE_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return DEVICE_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return DEVICE_SIMD_SSE42;
+#endif
+    return DEVICE_SIMD_SCALAR;
+}
+
+// RENDERER_SIMD=scalar, sse4.2 or avx2 caps the level, for A/B runs on one machine
+static int simd_requested(void) {
+    const char* name = getenv("RENDERER_SIMD");
+    if (name) {
+        if (strcmp(name, "scalar") == 0) return DEVICE_SIMD_SCALAR;
+        if (strcmp(name, "sse4.2") == 0) return DEVICE_SIMD_SSE42;
+    }
+    return DEVICE_SIMD_AVX2;
+}
+
+void device_simd(device_t *device, int level) {
+    level = MAX(MIN(level, simd_supported()), DEVICE_SIMD_SCALAR);
+    device->simd = level;
+    device->kernels = &kernels_scalar;
+#if defined(DEVICE_DISPATCH)
+    if (level == DEVICE_SIMD_SSE42) device->kernels = &kernels_sse42;
+    if (level == DEVICE_SIMD_AVX2) device->kernels = &kernels_avx2;
+#endif
+}
+
+// start an indexed draw over the whole bound vertex array, every entry becomes stale
+static void post_cache_begin(device_t* device) {
+    post_buffer_reserve(device, device->vertex_count);
+    if (++device->post_draw == 0) {
+        memset(device->post_stamp, 0, device->post_capacity * sizeof(unsigned));
+        device->post_draw = 1;
+    }
+}
+
+// quantized positions are decoded this many at a time on the stack
+#define VERTEX_DECODE_BLOCK 256
+
+static void decode_position(const device_t* device, int i, float* out) {
+    const uint16_t* q = device->vertex_u16 + i * 3;
+    out[0] = device->vertex_offset[0] + q[0] * device->vertex_scale[0];
+    out[1] = device->vertex_offset[1] + q[1] * device->vertex_scale[1];
+    out[2] = device->vertex_offset[2] + q[2] * device->vertex_scale[2];
+}
+
+// octahedral map back to the sphere, x in the low and y in the high snorm16
+static void decode_normal(const device_t* device, int i, float* out) {
+    uint32_t packed = device->normal_oct[i];
+    float x = MAX((int16_t)(packed & 0xffff) / 32767.0f, -1.0f);
+    float y = MAX((int16_t)(packed >> 16) / 32767.0f, -1.0f);
+    float z = 1 - fabsf(x) - fabsf(y);
+    if (z < 0) {
+        float fx = (1 - fabsf(y)) * (x < 0 ? -1 : 1);
+        float fy = (1 - fabsf(x)) * (y < 0 ? -1 : 1);
+        x = fx, y = fy;
+    }
+    float len = sqrtf(x * x + y * y + z * z);
+    out[0] = x / len, out[1] = y / len, out[2] = z / len;
+}
+
+static void fetch_normal(const device_t* device, int i, float* out) {
+    if (device->normal_oct) {
+        decode_normal(device, i, out);
+    }
+    else {
+        const float* n = device->normal_pointer + i * 3;
+        out[0] = n[0], out[1] = n[1], out[2] = n[2];
+    }
     
-    vertex_t v1, v2, v3;
+    // into world space, the length is left to the fragment stage
+    const float* m = device->instance_normal;
+    if (m) {
+        float x = out[0], y = out[1], z = out[2];
+        out[0] = m[0] * x + m[1] * y + m[2] * z;
+        out[1] = m[3] * x + m[4] * y + m[5] * z;
+        out[2] = m[6] * x + m[7] * y + m[8] * z;
+    }
+}
+
+static void fetch_texcoord(const device_t* device, int i, float* out) {
+    if (device->texcoord_u16) {
+        out[0] = device->texcoord_offset[0] + device->texcoord_u16[i * 2] * device->texcoord_scale[0];
+        out[1] = device->texcoord_offset[1] + device->texcoord_u16[i * 2 + 1] * device->texcoord_scale[1];
+    }
+    else {
+        out[0] = device->texcoord_pointer[i * 2];
+        out[1] = device->texcoord_pointer[i * 2 + 1];
+    }
+}
+
+// transform vertices first .. first + count - 1 of the bound positions into out[0 .. count - 1]
+static void vertex_stage(device_t* device, int first, int count, int classify, post_vertex_t* out) {
+    const float* m = device->transform.transform;
+    if (device->vertex_pointer) {
+        device->kernels->vertex_block(device, m, device->vertex_pointer + first * 3, count, classify, out);
+        return;
+    }
     
-    float * const pos1 = v1.position;
-    float * const pos2 = v2.position;
-    float * const pos3 = v3.position;
+    float positions[VERTEX_DECODE_BLOCK * 3];
+    for (int i = 0; i < count; i += VERTEX_DECODE_BLOCK) {
+        int n = MIN(count - i, VERTEX_DECODE_BLOCK);
+        for (int k = 0; k < n; k++) {
+            decode_position(device, first + i + k, positions + k * 3);
+        }
+        device->kernels->vertex_block(device, m, positions, n, classify, out + i);
+    }
+}
+
+// transformed vertex i, each index is transformed once per indexed draw
+static const post_vertex_t* post_cache_fetch(device_t* device, int i, int subpixel_bits, int classify) {
+    post_vertex_t* post = &device->post[i];
+    if (device->post_stamp[i] == device->post_draw) {
+        device->vertex_cache_hits++;
+    }
+    else {
+        device->vertex_cache_misses++;
+        device->post_stamp[i] = device->post_draw;
+        float position[3];
+        if (device->vertex_pointer) {
+            memcpy(position, device->vertex_pointer + i * 3, sizeof(position));
+        }
+        else {
+            decode_position(device, i, position);
+        }
+        post_vertex_scalar(device, device->transform.transform, position, subpixel_bits, classify, post);
+    }
+    return post;
+}
+
+// attributes of vertex i of the bound arrays, premultiplied by 1/w like vertex_pre_process
+static void raster_vertex_fetch(const device_t* device, const post_vertex_t* post, int i, raster_vertex_t* out) {
+    const varyings_t* varyings = &device->varyings;
+    float oneoverz = post->oneoverz;
+    out->x = post->x;
+    out->y = post->y;
+    out->v[0] = oneoverz;
+    if (varyings->color) {
+        const float* c = device->color_pointer + i * 4;
+        float* v = out->v + varyings->color;
+        v[0] = c[0] * oneoverz, v[1] = c[1] * oneoverz, v[2] = c[2] * oneoverz, v[3] = c[3] * oneoverz;
+    }
+    if (varyings->normal) {
+        fetch_normal(device, i, out->v + varyings->normal);
+    }
+    if (varyings->texcoord) {
+        float* v = out->v + varyings->texcoord;
+        fetch_texcoord(device, i, v);
+        v[0] *= oneoverz, v[1] *= oneoverz;
+    }
+}
+
+// vertex i of the bound arrays in clip space, for the clipper
+static void vertex_fetch(const device_t* device, const post_vertex_t* post, int i, vertex_t* v) {
+    const float* cp = device->color_pointer;
     
-    float * const normal1 = v1.normal;
-    float * const normal2 = v2.normal;
-    float * const normal3 = v3.normal;
+    v->position[0] = post->clip[0], v->position[1] = post->clip[1];
+    v->position[2] = post->clip[2], v->position[3] = post->clip[3];
     
-    float * const color1 = v1.color;
-    float * const color2 = v2.color;
-    float * const color3 = v3.color;
+    v->normal[0] = v->normal[1] = v->normal[2] = v->normal[3] = 0;
+    v->color[0] = v->color[1] = v->color[2] = v->color[3] = 1;
+    v->texcoord[0] = v->texcoord[1] = 0;
     
-    float * const texcoord1 = v1.texcoord;
-    float * const texcoord2 = v2.texcoord;
-    float * const texcoord3 = v3.texcoord;
+    if (device->normal_pointer || device->normal_oct) {
+        fetch_normal(device, i, v->normal);
+    }
+    if (cp) {
+        v->color[0] = cp[i * 4], v->color[1] = cp[i * 4 + 1], v->color[2] = cp[i * 4 + 2], v->color[3] = cp[i * 4 + 3];
+    }
+    if (device->texcoord_pointer || device->texcoord_u16) {
+        fetch_texcoord(device, i, v->texcoord);
+    }
+}
+
+// triangle assembly from the post transform buffer, i1, i2 and i3 index the bound arrays and
+// p1, p2 and p3 are their transformed vertices
+static void triangle_assemble_post(device_t* device, int bin, const post_vertex_t* p1, const post_vertex_t* p2, const post_vertex_t* p3,
+                                   int i1, int i2, int i3) {
+    if (triangle_culled(p1->clip, p2->clip, p3->clip, p1->codes, p2->codes, p3->codes)) {
+        return;
+    }
     
-    for (int i = 0; i < count;) {
-        int index = i * 3;
-        pos1[0] = vp[index + 0], pos1[1] = vp[index + 1], pos1[2] = vp[index + 2], pos1[3] = 1;
-        pos2[0] = vp[index + 3], pos2[1] = vp[index + 4], pos2[2] = vp[index + 5], pos2[3] = 1;
-        pos3[0] = vp[index + 6], pos3[1] = vp[index + 7], pos3[2] = vp[index + 8], pos3[3] = 1;
-        
-        normal1[0] = normal1[1] = normal1[2] = normal1[3] = 0;
-        normal2[0] = normal2[1] = normal2[2] = normal2[3] = 0;
-        normal3[0] = normal3[1] = normal3[2] = normal3[3] = 0;
+    int planes = (p1->codes | p2->codes | p3->codes) & CLIP_GEOMETRY;
+    if (!planes) {
+        raster_vertex_t tri[3];
+        raster_vertex_fetch(device, p1, i1, &tri[0]);
+        raster_vertex_fetch(device, p2, i2, &tri[1]);
+        raster_vertex_fetch(device, p3, i3, &tri[2]);
+        triangle_submit(device, bin, tri);
+    }
+    else {
+        vertex_t v1, v2, v3;
+        vertex_fetch(device, p1, i1, &v1);
+        vertex_fetch(device, p2, i2, &v2);
+        vertex_fetch(device, p3, i3, &v3);
+        triangle_clip(device, bin, planes, &v1, &v2, &v3);
+    }
+}
+
+//===================================================================
+//tiler
+//===================================================================
+
+typedef struct {
+    int* triangles;
+    int count;
+    int capacity;
+} bin_t;
+
+struct tiler_s {
+    pthread_t* workers;
+    int worker_count;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int generation;
+    int pending;
+    int quit;
+    int next_tile;
+    device_t* device;
+    
+    int tiles_x, tiles_y;
+    bin_t* bins;
+    
+    // three set up vertices per triangle, in submission order
+    raster_vertex_t* triangles;
+    int triangle_count;
+    int triangle_capacity;
+};
+
+static void tiler_raster_tile(struct tiler_s* tiler, int tile) {
+    device_t* device = tiler->device;
+    bin_t* bin = &tiler->bins[tile];
+    rect_t rect;
+    rect.x0 = (tile % tiler->tiles_x) * DEVICE_TILE_SIZE;
+    rect.y0 = (tile / tiler->tiles_x) * DEVICE_TILE_SIZE;
+    rect.x1 = MIN(rect.x0 + DEVICE_TILE_SIZE, (int)device->width);
+    rect.y1 = MIN(rect.y0 + DEVICE_TILE_SIZE, (int)device->height);
+    
+    for (int i = 0; i < bin->count; i++) {
+        triangle_raster(device, &rect, &tiler->triangles[bin->triangles[i] * 3]);
+    }
+}
+
+// tiles are handed out one at a time, each tile is owned by exactly one thread
+static void tiler_work(struct tiler_s* tiler) {
+    int count = tiler->tiles_x * tiler->tiles_y;
+    for (;;) {
+        pthread_mutex_lock(&tiler->lock);
+        int tile = tiler->next_tile++;
+        pthread_mutex_unlock(&tiler->lock);
         
-        color1[0] = color1[1] = color1[2] = color1[3] = 1;
-        color2[0] = color2[1] = color2[2] = color2[3] = 1;
-        color3[0] = color3[1] = color3[2] = color3[3] = 1;
+        if (tile >= count) break;
+        if (tiler->bins[tile].count) {
+            tiler_raster_tile(tiler, tile);
+        }
+    }
+}
+
+static void* tiler_worker(void* arg) {
+    struct tiler_s* tiler = (struct tiler_s*)arg;
+    int generation = 0;
+    
+    pthread_mutex_lock(&tiler->lock);
+    for (;;) {
+        while (!tiler->quit && tiler->generation == generation) {
+            pthread_cond_wait(&tiler->start, &tiler->lock);
+        }
+        if (tiler->quit) break;
+        generation = tiler->generation;
+        pthread_mutex_unlock(&tiler->lock);
         
-        texcoord1[0] = texcoord1[1] = 0;
-        texcoord2[0] = texcoord2[1] = 0;
-        texcoord3[0] = texcoord3[1] = 0;
+        tiler_work(tiler);
         
-        if (np) {
-            index = i * 3;
-            normal1[0] = np[index + 0], normal1[1] = np[index + 1], normal1[2] = np[index + 2], normal1[3] = 0;
-            normal2[0] = np[index + 3], normal2[1] = np[index + 4], normal2[2] = np[index + 5], normal2[3] = 0;
-            normal3[0] = np[index + 6], normal3[1] = np[index + 7], normal3[2] = np[index + 8], normal3[3] = 0;
+        pthread_mutex_lock(&tiler->lock);
+        if (--tiler->pending == 0) {
+            pthread_cond_signal(&tiler->done);
         }
-        
-        if (cp) {
-            index = i * 4;
-            color1[0] = cp[index + 0], color1[1] = cp[index + 1], color1[2] = cp[index + 2], color1[3] = cp[index + 3];
-            color2[0] = cp[index + 4], color2[1] = cp[index + 5], color2[2] = cp[index + 6], color2[3] = cp[index + 7];
-            color3[0] = cp[index + 8], color3[1] = cp[index + 9], color3[2] = cp[index + 10], color3[3] = cp[index + 11];
+    }
+    pthread_mutex_unlock(&tiler->lock);
+    return NULL;
+}
+
+static void tiler_create(device_t* device) {
+    struct tiler_s* tiler = (struct tiler_s*)calloc(1, sizeof(struct tiler_s));
+    tiler->tiles_x = (device->width + DEVICE_TILE_SIZE - 1) / DEVICE_TILE_SIZE;
+    tiler->tiles_y = (device->height + DEVICE_TILE_SIZE - 1) / DEVICE_TILE_SIZE;
+    tiler->bins = (bin_t*)calloc(tiler->tiles_x * tiler->tiles_y, sizeof(bin_t));
+    
+    pthread_mutex_init(&tiler->lock, NULL);
+    pthread_cond_init(&tiler->start, NULL);
+    pthread_cond_init(&tiler->done, NULL);
+    
+    // the calling thread rasterizes too
+    tiler->worker_count = device->threads - 1;
+    tiler->workers = (pthread_t*)malloc(tiler->worker_count * sizeof(pthread_t));
+    for (int i = 0; i < tiler->worker_count; i++) {
+        pthread_create(&tiler->workers[i], NULL, tiler_worker, tiler);
+    }
+    
+    device->tiler = tiler;
+}
+
+static void tiler_destroy(device_t* device) {
+    struct tiler_s* tiler = device->tiler;
+    
+    pthread_mutex_lock(&tiler->lock);
+    tiler->quit = 1;
+    pthread_cond_broadcast(&tiler->start);
+    pthread_mutex_unlock(&tiler->lock);
+    for (int i = 0; i < tiler->worker_count; i++) {
+        pthread_join(tiler->workers[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&tiler->lock);
+    pthread_cond_destroy(&tiler->start);
+    pthread_cond_destroy(&tiler->done);
+    
+    for (int i = 0; i < tiler->tiles_x * tiler->tiles_y; i++) {
+        free(tiler->bins[i].triangles);
+    }
+    free(tiler->bins);
+    free(tiler->triangles);
+    free(tiler->workers);
+    free(tiler);
+    device->tiler = NULL;
+}
+
+static void tiler_bin(device_t* device, const raster_vertex_t* tri) {
+    struct tiler_s* tiler = device->tiler;
+    
+    if (tiler->triangle_count == tiler->triangle_capacity) {
+        tiler->triangle_capacity = tiler->triangle_capacity ? tiler->triangle_capacity * 2 : 1024;
+        tiler->triangles = (raster_vertex_t*)realloc(tiler->triangles, tiler->triangle_capacity * 3 * sizeof(raster_vertex_t));
+    }
+    int id = tiler->triangle_count++;
+    memcpy(&tiler->triangles[id * 3], tri, 3 * sizeof(raster_vertex_t));
+    
+    // conservative bounds, one pixel of slack for rounding in the span setup
+    float minx = MIN(MIN(tri[0].x, tri[1].x), tri[2].x);
+    float maxx = MAX(MAX(tri[0].x, tri[1].x), tri[2].x);
+    float miny = MIN(MIN(tri[0].y, tri[1].y), tri[2].y);
+    float maxy = MAX(MAX(tri[0].y, tri[1].y), tri[2].y);
+    
+    int x0 = MAX((int)floorf(minx) - 1, 0) / DEVICE_TILE_SIZE;
+    int y0 = MAX((int)floorf(miny) - 1, 0) / DEVICE_TILE_SIZE;
+    int x1 = MIN((int)maxx + 1, (int)device->width - 1);
+    int y1 = MIN((int)maxy + 1, (int)device->height - 1);
+    if (x1 < 0 || y1 < 0) return;
+    x1 /= DEVICE_TILE_SIZE;
+    y1 /= DEVICE_TILE_SIZE;
+    
+    for (int ty = y0; ty <= y1; ty++) {
+        for (int tx = x0; tx <= x1; tx++) {
+            bin_t* bin = &tiler->bins[ty * tiler->tiles_x + tx];
+            if (bin->count == bin->capacity) {
+                bin->capacity = bin->capacity ? bin->capacity * 2 : 256;
+                bin->triangles = (int*)realloc(bin->triangles, bin->capacity * sizeof(int));
+            }
+            bin->triangles[bin->count++] = id;
         }
+    }
+}
+
+// rasterize everything binned so far and wait for the workers to finish
+static void tiler_flush(device_t* device) {
+    struct tiler_s* tiler = device->tiler;
+    if (!tiler || !tiler->triangle_count) return;
+    
+    pthread_mutex_lock(&tiler->lock);
+    tiler->device = device;
+    tiler->next_tile = 0;
+    tiler->pending = tiler->worker_count;
+    tiler->generation++;
+    pthread_cond_broadcast(&tiler->start);
+    pthread_mutex_unlock(&tiler->lock);
+    
+    tiler_work(tiler);
+    
+    pthread_mutex_lock(&tiler->lock);
+    while (tiler->pending) {
+        pthread_cond_wait(&tiler->done, &tiler->lock);
+    }
+    pthread_mutex_unlock(&tiler->lock);
+    
+    for (int i = 0; i < tiler->tiles_x * tiler->tiles_y; i++) {
+        tiler->bins[i].count = 0;
+    }
+    tiler->triangle_count = 0;
+}
+
+typedef struct {
+    int depth_func;
+    int depth_write;
+    int color_write;
+} depth_state_t;
+
+// a draw with depth writes masked off leaves the z-buffer alone, so it is shaded in one pass
+// against the stored depth instead of laying down its own first
+static int depth_prepass_active(const device_t* device) {
+    return device->depth_prepass && device->depth_write;
+}
+
+// pre-pass: depth only with the caller's depth func
+static void depth_prepass_begin(device_t* device, depth_state_t* saved) {
+    saved->depth_func = device->depth_func;
+    saved->depth_write = device->depth_write;
+    saved->color_write = device->color_write;
+    device->depth_write = 1;
+    device->color_write = 0;
+}
+
+// shading pass: only fragments whose depth survived the pre-pass
+static void depth_prepass_shade(device_t* device, const depth_state_t* saved) {
+    device->depth_func = DEVICE_DEPTH_EQUAL;
+    device->depth_write = 0;
+    device->color_write = saved->color_write;
+}
+
+static void depth_prepass_end(device_t* device, const depth_state_t* saved) {
+    device->depth_func = saved->depth_func;
+    device->depth_write = saved->depth_write;
+    device->color_write = saved->color_write;
+}
+
+#define VISIBLE_OUTSIDE 0
+#define VISIBLE_PARTIAL 1
+#define VISIBLE_INSIDE 2
+
+// the bounds of the vertex array against the clip volume of the MVP m. the planes are
+// sums and differences of the matrix rows (Gribb and Hartmann) in object space and are not
+// normalized, so the sphere test compares squares. the sphere settles most planes, the box
+// only the ones the sphere straddles
+static int bounds_visibility(const device_t* device, const float* m) {
+    if (!device->has_bounds) return VISIBLE_PARTIAL;
+    
+    const float* c = device->bounds_center;
+    const float* e = device->bounds_extent;
+    float r2 = device->bounds_radius * device->bounds_radius;
+    int visibility = VISIBLE_INSIDE;
+    
+    for (int i = 0; i < 6; i++) {
+        int axis = i >> 1;
+        float sign = (i & 1) ? -1.0f : 1.0f;
+        float a = m[3] + sign * m[axis];
+        float b = m[7] + sign * m[4 + axis];
+        float d = m[11] + sign * m[8 + axis];
+        float w = m[15] + sign * m[12 + axis];
         
-        if (tp) {
-            index = i * 2;
-            texcoord1[0] = tp[index + 0], texcoord1[1] = tp[index + 1];
-            texcoord2[0] = tp[index + 2], texcoord2[1] = tp[index + 3];
-            texcoord3[0] = tp[index + 4], texcoord3[1] = tp[index + 5];
+        float s = a * c[0] + b * c[1] + d * c[2] + w;
+        float n2 = a * a + b * b + d * d;
+        if (s * s >= r2 * n2) {
+            if (s < 0) return VISIBLE_OUTSIDE;
+            continue;
         }
         
-        draw_triangle(device, &v1, &v2, &v3);
+        float extent = e[0] * fabsf(a) + e[1] * fabsf(b) + e[2] * fabsf(d);
+        if (s + extent < 0) return VISIBLE_OUTSIDE;
+        if (s - extent < 0) visibility = VISIBLE_PARTIAL;
+    }
+    
+    return visibility;
+}
+
+static void draw_arrays_pass(device_t* device, int offset, int count, int visibility) {
+    if (!device->vertex_pointer && !device->vertex_u16) return;
+    if (device->vertex_count < offset + count) return;
+    
+    draw_setup(device, draw_varyings(device));
+    
+    post_vertex_t* post = post_buffer_reserve(device, count);
+    vertex_stage(device, offset, count, visibility != VISIBLE_INSIDE, post);
+    
+    int bin = device->tiler != NULL;
+    for (int i = 0; i + 2 < count; i += 3) {
+        triangle_assemble_post(device, bin, &post[i], &post[i + 1], &post[i + 2], offset + i, offset + i + 1, offset + i + 2);
+    }
+    
+    tiler_flush(device);
+}
+
+static void draw_elements_pass(device_t* device, int* indices, int count, int visibility) {
+    if (!device->vertex_pointer && !device->vertex_u16) return;
+    if (!indices) return;
+    
+    draw_setup(device, draw_varyings(device));
+    post_cache_begin(device);
+    
+    int subpixel_bits = device->raster_mode == DEVICE_RASTER_FIXED ? device->subpixel_bits : 0;
+    int classify = visibility != VISIBLE_INSIDE;
+    int bin = device->tiler != NULL;
+    unsigned n = (unsigned)device->vertex_count;
+    for (int i = 0; i + 2 < count; i += 3) {
+        int i1 = indices[i], i2 = indices[i + 1], i3 = indices[i + 2];
+        if ((unsigned)i1 >= n || (unsigned)i2 >= n || (unsigned)i3 >= n) continue;
         
-        i += 3;
+        const post_vertex_t* p1 = post_cache_fetch(device, i1, subpixel_bits, classify);
+        const post_vertex_t* p2 = post_cache_fetch(device, i2, subpixel_bits, classify);
+        const post_vertex_t* p3 = post_cache_fetch(device, i3, subpixel_bits, classify);
+        triangle_assemble_post(device, bin, p1, p2, p3, i1, i2, i3);
+    }
+    
+    tiler_flush(device);
+}
+
+void draw_arrays(device_t* device, int offset, int count) {
+    int visibility = bounds_visibility(device, device->transform.transform);
+    if (visibility == VISIBLE_OUTSIDE) return;
+    
+    if (depth_prepass_active(device)) {
+        depth_state_t saved;
+        depth_prepass_begin(device, &saved);
+        draw_arrays_pass(device, offset, count, visibility);
+        depth_prepass_shade(device, &saved);
+        draw_arrays_pass(device, offset, count, visibility);
+        depth_prepass_end(device, &saved);
+    }
+    else {
+        draw_arrays_pass(device, offset, count, visibility);
     }
 }
 
 void draw_elements(device_t* device, int* indices, int count) {
-    float * vp = device->vertex_pointer;
-    if (!vp || !indices) return;
-    
-    float * np = device->normal_pointer;
-    float * tp = device->texcoord_pointer;
-    float * cp = device->color_pointer;
-    
-    vertex_t v1, v2, v3;
-    
-    float * const pos1 = v1.position;
-    float * const pos2 = v2.position;
-    float * const pos3 = v3.position;
-    
-    float * const normal1 = v1.normal;
-    float * const normal2 = v2.normal;
-    float * const normal3 = v3.normal;
-    
-    float * const color1 = v1.color;
-    float * const color2 = v2.color;
-    float * const color3 = v3.color;
-    
-    float * const texcoord1 = v1.texcoord;
-    float * const texcoord2 = v2.texcoord;
-    float * const texcoord3 = v3.texcoord;
-    
-    int index1, index2, index3;
-    for (int i = 0; i < count;) {
-        index1 = indices[i * 3];
-        index2 = indices[i * 3 + 1];
-        index3 = indices[i * 3 + 2];
-        pos1[0] = vp[index1 + 0], pos1[1] = vp[index1 + 1], pos1[2] = vp[index1 + 2], pos1[3] = 1;
-        pos2[0] = vp[index2 + 0], pos2[1] = vp[index2 + 1], pos2[2] = vp[index2 + 2], pos2[3] = 1;
-        pos3[0] = vp[index3 + 0], pos3[1] = vp[index3 + 1], pos3[2] = vp[index3 + 2], pos3[3] = 1;
-        
-        normal1[0] = normal1[1] = normal1[2] = normal1[3] = 0;
-        normal2[0] = normal2[1] = normal2[2] = normal2[3] = 0;
-        normal3[0] = normal3[1] = normal3[2] = normal3[3] = 0;
-        
-        color1[0] = color1[1] = color1[2] = color1[3] = 1;
-        color2[0] = color2[1] = color2[2] = color2[3] = 1;
-        color3[0] = color3[1] = color3[2] = color3[3] = 1;
-        
-        texcoord1[0] = texcoord1[1] = 0;
-        texcoord2[0] = texcoord2[1] = 0;
-        texcoord3[0] = texcoord3[1] = 0;
+    int visibility = bounds_visibility(device, device->transform.transform);
+    if (visibility == VISIBLE_OUTSIDE) return;
+    
+    if (depth_prepass_active(device)) {
+        depth_state_t saved;
+        depth_prepass_begin(device, &saved);
+        draw_elements_pass(device, indices, count, visibility);
+        depth_prepass_shade(device, &saved);
+        draw_elements_pass(device, indices, count, visibility);
+        depth_prepass_end(device, &saved);
+    }
+    else {
+        draw_elements_pass(device, indices, count, visibility);
+    }
+}
+
+//===================================================================
+//instancing
+//===================================================================
+
+// instances go through the vertex stage in groups whose transformed vertices fit in this many post
+// entries, small enough to still be in cache when assembly reads them back
+#define INSTANCE_POST_VERTICES 16384
+// draw_arrays_instanced works through the array this many vertices at a time, whole triangles
+#define INSTANCE_CHUNK (VERTEX_DECODE_BLOCK * 3)
+// model matrices multiplied per mat4_multiply_batch call
+#define INSTANCE_BATCH 64
+
+// one instance of an instanced draw: its MVP, the normal matrix taking its model space normals
+// to world space and where its bounds lie against the view volume
+typedef struct instance_s {
+    float transform[16];
+    float normal[9];
+    int visibility;
+} instance_t;
+
+// inverse transpose of the upper 3x3 of the column major m, row major, as cofactors over the
+// determinant so affine models never need a full mat4_invert
+static void normal_matrix(float* out, const float* m) {
+    float a00 = m[0], a01 = m[4], a02 = m[8];
+    float a10 = m[1], a11 = m[5], a12 = m[9];
+    float a20 = m[2], a21 = m[6], a22 = m[10];
+    
+    out[0] = a11 * a22 - a12 * a21;
+    out[1] = a12 * a20 - a10 * a22;
+    out[2] = a10 * a21 - a11 * a20;
+    out[3] = a02 * a21 - a01 * a22;
+    out[4] = a00 * a22 - a02 * a20;
+    out[5] = a01 * a20 - a00 * a21;
+    out[6] = a01 * a12 - a02 * a11;
+    out[7] = a02 * a10 - a00 * a12;
+    out[8] = a00 * a11 - a01 * a10;
+    
+    float det = a00 * out[0] + a01 * out[1] + a02 * out[2];
+    float inv = det != 0 ? 1 / det : 0;
+    for (int k = 0; k < 9; k++) out[k] *= inv;
+}
+
+// matrices of every instance in one go, view and projection are multiplied once. instances
+// outside the view volume are dropped, returns how many are left in device->instances
+static int instances_setup(device_t* device, const float* models, int count) {
+    if (device->instance_capacity < count) {
+        device->instance_capacity = MAX(count, device->instance_capacity * 2);
+        free(device->instances);
+        device->instances = (instance_t*)malloc(device->instance_capacity * sizeof(instance_t));
+    }
+    
+    float view_projection[16];
+    mat4_multiply(view_projection, device->transform.projection, device->transform.view);
+    
+    // MVPs a batch at a time, then the ones in view are kept
+    float transforms[INSTANCE_BATCH * 16];
+    int visible = 0;
+    for (int first = 0; first < count; first += INSTANCE_BATCH) {
+        int n = MIN(count - first, INSTANCE_BATCH);
+        mat4_multiply_batch(transforms, view_projection, models + first * 16, n);
         
-        if (np) {
-            index1 = indices[i * 3];
-            index2 = indices[i * 3 + 1];
-            index3 = indices[i * 3 + 2];
-            normal1[0] = np[index1 + 0], normal1[1] = np[index1 + 1], normal1[2] = np[index1 + 2], normal1[3] = 0;
-            normal2[0] = np[index2 + 0], normal2[1] = np[index2 + 1], normal2[2] = np[index2 + 2], normal2[3] = 0;
-            normal3[0] = np[index3 + 0], normal3[1] = np[index3 + 1], normal3[2] = np[index3 + 2], normal3[3] = 0;
+        for (int k = 0; k < n; k++) {
+            instance_t* instance = &device->instances[visible];
+            instance->visibility = bounds_visibility(device, transforms + k * 16);
+            if (instance->visibility == VISIBLE_OUTSIDE) continue;
+            
+            memcpy(instance->transform, transforms + k * 16, sizeof(instance->transform));
+            normal_matrix(instance->normal, models + (first + k) * 16);
+            visible++;
         }
-        
-        if (cp) {
-            index1 = indices[i * 4];
-            index2 = indices[i * 4 + 1];
-            index3 = indices[i * 4 + 2];
-            color1[0] = cp[index1 + 0], color1[1] = cp[index1 + 1], color1[2] = cp[index1 + 2], color1[3] = cp[index1 + 3];
-            color2[0] = cp[index2 + 0], color2[1] = cp[index2 + 1], color2[2] = cp[index2 + 2], color2[3] = cp[index2 + 3];
-            color3[0] = cp[index3 + 0], color3[1] = cp[index3 + 1], color3[2] = cp[index3 + 2], color3[3] = cp[index3 + 3];
+    }
+    return visible;
+}
+
+// normals reach the fragment stage in world space, so is the light
+static void draw_setup_instanced(device_t* device) {
+    draw_setup(device, draw_varyings(device));
+    if (device->lighting) {
+        float identity[16];
+        mat4_identity(identity);
+        lighting_setup(device, identity);
+    }
+}
+
+// transform vertices first .. first + count - 1 for each of the count instances, instance k into
+// out[k * count .. k * count + count - 1]. a block of positions goes through every instance
+// before the next block is read, so it is fetched or decoded once and stays in cache
+static void vertex_stage_instanced(device_t* device, int first, int count, const instance_t* instances, int n, post_vertex_t* out) {
+    float positions[VERTEX_DECODE_BLOCK * 3];
+    for (int i = 0; i < count; i += VERTEX_DECODE_BLOCK) {
+        int block = MIN(count - i, VERTEX_DECODE_BLOCK);
+        const float* p = positions;
+        if (device->vertex_pointer) {
+            p = device->vertex_pointer + (first + i) * 3;
         }
-        
-        if (tp) {
-            index1 = indices[i * 2];
-            index2 = indices[i * 2 + 1];
-            index3 = indices[i * 2 + 2];
-            texcoord1[0] = tp[index1 + 0], texcoord1[1] = tp[index1 + 1];
-            texcoord2[0] = tp[index2 + 0], texcoord2[1] = tp[index2 + 1];
-            texcoord3[0] = tp[index3 + 0], texcoord3[1] = tp[index3 + 1];
+        else {
+            for (int k = 0; k < block; k++) {
+                decode_position(device, first + i + k, positions + k * 3);
+            }
         }
         
-        draw_triangle(device, &v1, &v2, &v3);
+        for (int k = 0; k < n; k++) {
+            int classify = instances[k].visibility != VISIBLE_INSIDE;
+            device->kernels->vertex_block(device, instances[k].transform, p, block, classify, out + k * count + i);
+        }
+    }
+}
+
+static void draw_arrays_instanced_pass(device_t* device, int offset, int count, int instances) {
+    if (!device->vertex_pointer && !device->vertex_u16) return;
+    if (device->vertex_count < offset + count || count <= 0) return;
+    
+    draw_setup_instanced(device);
+    
+    int bin = device->tiler != NULL;
+    int group = MAX(1, INSTANCE_POST_VERTICES / INSTANCE_CHUNK);
+    for (int first = 0; first < instances; first += group) {
+        int n = MIN(group, instances - first);
+        for (int start = 0; start < count; start += INSTANCE_CHUNK) {
+            int size = MIN(count - start, INSTANCE_CHUNK);
+            post_vertex_t* post = post_buffer_reserve(device, size * n);
+            vertex_stage_instanced(device, offset + start, size, device->instances + first, n, post);
+            
+            for (int k = 0; k < n; k++) {
+                const post_vertex_t* p = post + k * size;
+                int base = offset + start;
+                device->instance_normal = device->instances[first + k].normal;
+                for (int i = 0; i + 2 < size; i += 3) {
+                    triangle_assemble_post(device, bin, &p[i], &p[i + 1], &p[i + 2], base + i, base + i + 1, base + i + 2);
+                }
+            }
+        }
+        // bins grow with every instance, rasterize them per group
+        tiler_flush(device);
+    }
+    device->instance_normal = NULL;
+}
+
+// the whole vertex array is transformed per instance instead of going through the post transform
+// cache, the indices of a mesh reference nearly all of it anyway
+static void draw_elements_instanced_pass(device_t* device, int* indices, int count, int instances) {
+    if (!device->vertex_pointer && !device->vertex_u16) return;
+    if (!indices || device->vertex_count <= 0) return;
+    
+    draw_setup_instanced(device);
+    
+    int bin = device->tiler != NULL;
+    int vertex_count = device->vertex_count;
+    unsigned range = (unsigned)vertex_count;
+    int group = MAX(1, INSTANCE_POST_VERTICES / vertex_count);
+    for (int first = 0; first < instances; first += group) {
+        int n = MIN(group, instances - first);
+        post_vertex_t* post = post_buffer_reserve(device, vertex_count * n);
+        vertex_stage_instanced(device, 0, vertex_count, device->instances + first, n, post);
         
-        i += 3;
+        for (int k = 0; k < n; k++) {
+            const post_vertex_t* p = post + k * vertex_count;
+            device->instance_normal = device->instances[first + k].normal;
+            for (int i = 0; i + 2 < count; i += 3) {
+                int i1 = indices[i], i2 = indices[i + 1], i3 = indices[i + 2];
+                if ((unsigned)i1 >= range || (unsigned)i2 >= range || (unsigned)i3 >= range) continue;
+                triangle_assemble_post(device, bin, &p[i1], &p[i2], &p[i3], i1, i2, i3);
+            }
+        }
+        tiler_flush(device);
+    }
+    device->instance_normal = NULL;
+}
+
+void draw_arrays_instanced(device_t* device, int offset, int count, const float* models, int instances) {
+    instances = instances_setup(device, models, instances);
+    if (instances == 0) return;
+    
+    if (depth_prepass_active(device)) {
+        depth_state_t saved;
+        depth_prepass_begin(device, &saved);
+        draw_arrays_instanced_pass(device, offset, count, instances);
+        depth_prepass_shade(device, &saved);
+        draw_arrays_instanced_pass(device, offset, count, instances);
+        depth_prepass_end(device, &saved);
+    }
+    else {
+        draw_arrays_instanced_pass(device, offset, count, instances);
+    }
+}
+
+void draw_elements_instanced(device_t* device, int* indices, int count, const float* models, int instances) {
+    instances = instances_setup(device, models, instances);
+    if (instances == 0) return;
+    
+    if (depth_prepass_active(device)) {
+        depth_state_t saved;
+        depth_prepass_begin(device, &saved);
+        draw_elements_instanced_pass(device, indices, count, instances);
+        depth_prepass_shade(device, &saved);
+        draw_elements_instanced_pass(device, indices, count, instances);
+        depth_prepass_end(device, &saved);
+    }
+    else {
+        draw_elements_instanced_pass(device, indices, count, instances);
     }
 }
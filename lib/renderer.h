@@ -47,6 +47,8 @@ void mat4_invert(float * out, const float* m);
 
 // multiply
 void mat4_multiply(float* out, const float* a, const float* b);
+// out[i] = a * b[i] over count matrices stored one after another
+void mat4_multiply_batch(float* out, const float* a, const float* b, int count);
 
 // translate
 void mat4_translate(float* out, const float* m, const float* v);
@@ -59,6 +61,8 @@ void mat4_rotate(float* out, const float* m, float rad, const float* v);
 
 // apply
 void mat4_apply(float* out, const float* m, const float* v);
+// out[i] = m * v[i] over count vec4s
+void mat4_apply_batch(float* out, const float* m, const float* v, int count);
 
 // perspective
 void mat4_perspective(float* out, float fovy, float aspect, float near, float far);
@@ -94,13 +98,42 @@ typedef struct {
     float oneoverz;
 } vertex_t;
 
+// mip levels down to 1x1 of a texture up to 32768 texels wide
+#define DEVICE_TEXTURE_LEVELS 16
+
+// immutable once created, so one texture may be bound to devices on different threads.
+// device_bind_texture holds a reference and the last device_del_texture frees it
 typedef struct {
     int type;
     int width;
     int height;
     uint32_t* data;
+    int refcount;
+    // mip chain built by device_gen_texture, level 0 starts data, each level halves the one before
+    int levels;
+    int level_width[DEVICE_TEXTURE_LEVELS];
+    int level_height[DEVICE_TEXTURE_LEVELS];
+    uint32_t* level_data[DEVICE_TEXTURE_LEVELS];
+    // texels are stored in rows of 2^tile_shift square tiles, stride counts texels when tile_shift
+    // is 0 and tiles otherwise
+    int tile_shift;
+    int level_stride[DEVICE_TEXTURE_LEVELS];
 } texture_t;
 
+// immutable block of vertex data shared like texture_t, see device_vertex_buffer
+typedef struct {
+    void* data;
+    int size;           // in bytes
+    int refcount;
+} buffer_t;
+
+// attribute streams a device can hold a buffer_t reference for
+#define DEVICE_BUFFER_VERTEX 0
+#define DEVICE_BUFFER_NORMAL 1
+#define DEVICE_BUFFER_TEXCOORD 2
+#define DEVICE_BUFFER_COLOR 3
+#define DEVICE_BUFFER_COUNT 4
+
 typedef struct {
     float color[3];
     float postion[3];
@@ -113,49 +146,217 @@ typedef struct {
 #define DEVICE_DRAW_MODE_NORMAL 1
 #define DEVICE_DRAW_MODE_WILD 2
 
+// attributes interpolated across triangles besides 1/w, worked out per draw from the bound pointers
+#define VARYING_COLOR 1
+#define VARYING_NORMAL 2
+#define VARYING_TEXCOORD 4
+#define VARYING_ALL (VARYING_COLOR | VARYING_NORMAL | VARYING_TEXCOORD)
+#define VARYING_MAX 10
+
+// packed layout: 1/w first, then color, normal and texcoord when present, offsets are 0 when absent
+typedef struct {
+    int mask;
+    int count;
+    int color;
+    int normal;
+    int texcoord;
+} varyings_t;
+
+// triangle fill algorithm, see device_raster_mode
+#define DEVICE_RASTER_SCANLINE 0
+#define DEVICE_RASTER_HALFSPACE 1
+#define DEVICE_RASTER_FIXED 2
+
+// depth comparison in terms of distance, like glDepthFunc, LESS passes nearer fragments
+#define DEVICE_DEPTH_NEVER 0
+#define DEVICE_DEPTH_LESS 1
+#define DEVICE_DEPTH_EQUAL 2
+#define DEVICE_DEPTH_LEQUAL 3
+#define DEVICE_DEPTH_GREATER 4
+#define DEVICE_DEPTH_NOTEQUAL 5
+#define DEVICE_DEPTH_GEQUAL 6
+#define DEVICE_DEPTH_ALWAYS 7
+
+// texel layout, the type of device_gen_texture
+#define DEVICE_TEXTURE_ROWS 0           // row-major
+#define DEVICE_TEXTURE_TILED 1          // 4x4 tiles of one 64 byte cache line, neighbours in v are as close as in u
+
+// texture sampling, see device_texture_filter. the mipmapped modes pick a level per 2x2 pixel quad
+#define DEVICE_TEXTURE_NEAREST 0            // nearest texel of level 0
+#define DEVICE_TEXTURE_NEAREST_MIPMAP 1     // nearest texel of the nearest level
+#define DEVICE_TEXTURE_TRILINEAR 2          // bilinear in the two nearest levels, blended
+#define DEVICE_TEXTURE_BILINEAR 3           // bilinear in level 0, four pixels at a time
+
+// texture addressing outside [0, 1], see device_texture_wrap. repeat is a mask on power of two sizes
+#define DEVICE_TEXTURE_CLAMP 0
+#define DEVICE_TEXTURE_REPEAT 1
+
+// instruction sets the span, vertex transform and clear kernels are built for. device_init picks
+// the best one the CPU runs, AVX-512 hosts run the AVX2 kernels
+#define DEVICE_SIMD_SCALAR 0
+#define DEVICE_SIMD_SSE42 1
+#define DEVICE_SIMD_AVX2 2
+
+// screen tile edge in pixels, used by the multithreaded binning rasterizer
+#define DEVICE_TILE_SIZE 64
+
+// coarse depth bounds over 8x8 pixel blocks and over whole tiles, zbuffer holds 1/w so
+// "far" is the smallest stored value and "near" the largest
+typedef struct {
+    int width, height;          // in blocks
+    int tiles_x, tiles_y;
+    float* block_far;
+    float* block_near;
+    uint8_t* block_dirty;       // far may be lower than the real minimum
+    float* tile_far;
+    uint8_t* tile_dirty;
+} hiz_t;
+
+// worker pool and per tile triangle bins, only allocated when threads > 1
+struct tiler_s;
+// transformed vertices of the current draw
+struct post_vertex_s;
+// matrices of one instance of an instanced draw
+struct instance_s;
+
 typedef struct {
     transform_t transform;
     uint32_t width;
     uint32_t height;
     uint32_t* framebuffer;
     float* zbuffer;
+    hiz_t hiz;
     
     float* vertex_pointer;
     int vertex_count;
     float* normal_pointer;
     float* texcoord_pointer;
     float* color_pointer;
+    // quantized streams, each one replaces the float pointer of its attribute while it is set
+    const uint16_t* vertex_u16;
+    float vertex_offset[3];
+    float vertex_scale[3];
+    const uint32_t* normal_oct;
+    const uint16_t* texcoord_u16;
+    float texcoord_offset[2];
+    float texcoord_scale[2];
+    // object space bounds of the vertex array as a box and the sphere around it
+    int has_bounds;
+    float bounds_center[3];
+    float bounds_extent[3];
+    float bounds_radius;
+    // references behind the float pointers bound through device_xxx_buffer, NULL otherwise
+    buffer_t* buffers[DEVICE_BUFFER_COUNT];
     
     int lighting;
     light_t lights[1];
+    // lights[0] direction and half vector in model space, set up per draw and by device_light
+    float light_dir[4];
+    float light_half[4];
     
     int draw_mode;
+    int raster_mode;
+    int subpixel_bits;
+    
+    int depth_func;
+    int depth_write;
+    int color_write;
+    int depth_prepass;
+    
+    varyings_t varyings;
+    int span_kernel;    // shading loop picked per draw from lighting, texture, sampler, colors and color mask
     
     texture_t* texture;
+    int texture_filter;
+    int texture_wrap;
+    
+    struct post_vertex_s* post;
+    unsigned* post_stamp;       // indexed draw that last transformed each post entry
+    unsigned post_draw;
+    int post_capacity;
+    // post transform cache of draw_elements, a hit is an index already transformed in the same
+    // draw, counted since device_init and only ever reset by the caller
+    unsigned vertex_cache_hits;
+    unsigned vertex_cache_misses;
+    
+    struct instance_s* instances;
+    int instance_capacity;
+    const float* instance_normal;   // normal matrix of the instance being assembled, NULL outside instanced draws
+    
+    int simd;                           // DEVICE_SIMD_* level of kernels
+    const struct kernels_s* kernels;
+    
+    int threads;
+    struct tiler_s* tiler;
     
 } device_t;
 
+// a device keeps no state outside device_t and touches nothing but the textures and arrays bound
+// to it, so independent devices can be driven from different threads at the same time
 void device_init(device_t * device, uint32_t width, uint32_t height);
+// threads > 1: triangles are binned into DEVICE_TILE_SIZE tiles and rasterized by worker threads
+void device_init_threads(device_t * device, uint32_t width, uint32_t height, int threads);
 void device_destroy(device_t *device);
+// cap the kernels at level, clamped to what the CPU runs. device_init starts at the best level
+// unless RENDERER_SIMD names a lower one ("scalar", "sse4.2")
+void device_simd(device_t *device, int level);
 void device_clear(device_t *device);
 
 void device_vertex_pointer(device_t *device, int count, float* pointer);
 void device_normal_pointer(device_t *device, float* pointer);
 void device_color_pointer(device_t *device, float* pointer);
 void device_texcoord_pointer(device_t *device, float* pointer);
+// quantized streams, decoded as vertices are fetched: positions are xyz uint16 spanning min .. max,
+// normals are octahedral with x and y snorm16 in the low and high half, texcoords are uv uint16
+// spanning min .. max, so tiling uvs outside [0, 1] survive
+void device_vertex_pointer_u16(device_t *device, int count, const uint16_t* pointer, const float* min, const float* max);
+void device_normal_pointer_oct(device_t *device, const uint32_t* pointer);
+void device_texcoord_pointer_u16(device_t *device, const uint16_t* pointer, const float* min, const float* max);
+// the float streams from shared buffers, the device holds a reference until the stream is bound
+// again or the device is destroyed
+void device_vertex_buffer(device_t *device, int count, buffer_t* buffer);
+void device_normal_buffer(device_t *device, buffer_t* buffer);
+void device_color_buffer(device_t *device, buffer_t* buffer);
+void device_texcoord_buffer(device_t *device, buffer_t* buffer);
+// box around every position of the vertex array: draws entirely outside the view are dropped
+// up front and draws entirely inside skip clipping, cleared by device_vertex_pointer
+void device_vertex_bounds(device_t *device, const float* min, const float* max);
 
 void device_draw_mode(device_t *device, int mode);
+// DEVICE_RASTER_SCANLINE, DEVICE_RASTER_HALFSPACE (edge functions over 8x8 blocks) or
+// DEVICE_RASTER_FIXED (integer edge functions on a subpixel grid with a top-left fill rule)
+void device_raster_mode(device_t *device, int mode);
+// subpixel precision of DEVICE_RASTER_FIXED, 4 by default
+void device_subpixel_bits(device_t *device, int bits);
+
+void device_depth_func(device_t *device, int func);
+void device_depth_mask(device_t *device, int write);
+void device_color_mask(device_t *device, int write);
+// draw calls lay down depth first, then shade only the fragments that are still visible.
+// draws made with device_depth_mask(device, 0) skip the pre-pass and never write depth
+void device_depth_prepass(device_t *device, int enable);
 
 void device_enable_light(device_t *device, int light);
 void device_disable_light(device_t *device, int light);
 
 void device_light(device_t *device, float* postion, float* color, float ka, float kd, float ks, uint16_t shininess);
 
-// rgba only
+// rgba only, type is DEVICE_TEXTURE_ROWS or DEVICE_TEXTURE_TILED. NULL when out of memory
 texture_t* device_gen_texture(int type, int width, int height, uint8_t* data);
+// reference counting is atomic, any thread may retain or delete
+texture_t* device_retain_texture(texture_t* tex);
 void device_del_texture(texture_t* tex);
 void device_update_texture(texture_t* tex, int x, int y, int w, int h);
 void device_bind_texture(device_t *device, texture_t* tex);
+// DEVICE_TEXTURE_NEAREST by default
+void device_texture_filter(device_t *device, int filter);
+// DEVICE_TEXTURE_CLAMP by default
+void device_texture_wrap(device_t *device, int wrap);
+
+// copies size bytes of data
+buffer_t* device_gen_buffer(const void* data, int size);
+buffer_t* device_retain_buffer(buffer_t* buffer);
+void device_del_buffer(buffer_t* buffer);
 
 void vertex_interp(vertex_t* out, const vertex_t* v1, const vertex_t* v2, float t);
 
@@ -167,6 +368,11 @@ void draw_triangle(device_t* device, vertex_t* v1, vertex_t* v2, vertex_t* v3);
 void draw_arrays(device_t* device, int offset, int count);
 void draw_elements(device_t* device, int* indices, int count);
 
+// draw the bound arrays once per model matrix, models holds instances column major 4x4 matrices
+// that stand in for transform.model, view and projection are shared. lighting is done in world space
+void draw_arrays_instanced(device_t* device, int offset, int count, const float* models, int instances);
+void draw_elements_instanced(device_t* device, int* indices, int count, const float* models, int instances);
+
 
 
 
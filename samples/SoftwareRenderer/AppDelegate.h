@@ -38,6 +38,8 @@
 
 -(NSImage*)makeNSImage;
 -(void)draw;
+-(void)benchmark;
+-(void)benchmarkMath;
 
 -(IBAction)btnPressed:(id)sender;
 -(IBAction)checkAction:(id)sender;
@@ -11,6 +11,31 @@
 #import "models/ateneal.h"
 #import "banana.h"
 
+// the scalar mat4_multiply and mat4_apply of the library, benchmarkMath times the build's own
+// kernels against them
+__attribute__((noinline)) static void mat4_multiply_scalar(float* out, const float* a, const float* b) {
+    float a00 = a[0],  a01 = a[1],  a02 = a[2],  a03 = a[3],
+          a10 = a[4],  a11 = a[5],  a12 = a[6],  a13 = a[7],
+          a20 = a[8],  a21 = a[9],  a22 = a[10], a23 = a[11],
+          a30 = a[12], a31 = a[13], a32 = a[14], a33 = a[15];
+    
+    for (int j = 0; j < 16; j += 4) {
+        float b0 = b[j], b1 = b[j + 1], b2 = b[j + 2], b3 = b[j + 3];
+        out[j]     = b0*a00 + b1*a10 + b2*a20 + b3*a30;
+        out[j + 1] = b0*a01 + b1*a11 + b2*a21 + b3*a31;
+        out[j + 2] = b0*a02 + b1*a12 + b2*a22 + b3*a32;
+        out[j + 3] = b0*a03 + b1*a13 + b2*a23 + b3*a33;
+    }
+}
+
+__attribute__((noinline)) static void mat4_apply_scalar(float* out, const float* m, const float* v) {
+    float x = v[0], y = v[1], z = v[2], w = v[3];
+    out[0] = x * m[0] + y * m[4] + z * m[8]  + w * m[12];
+    out[1] = x * m[1] + y * m[5] + z * m[9]  + w * m[13];
+    out[2] = x * m[2] + y * m[6] + z * m[10] + w * m[14];
+    out[3] = x * m[3] + y * m[7] + z * m[11] + w * m[15];
+}
+
 @interface AppDelegate ()
 
 @property (weak) IBOutlet NSWindow *window;
@@ -52,7 +77,7 @@
     width = 320 * 2;
     height = 320 * 2;
     
-    device_init(&device, width, height);
+    device_init_threads(&device, width, height, (int)[[NSProcessInfo processInfo] activeProcessorCount]);
     device_clear(&device);
     
     float value = [sliderView floatValue];
@@ -79,6 +104,20 @@
     bmp = (NSBitmapImageRep *)[[img representations] objectAtIndex:0];
     tex[1] = device_gen_texture(0, (int)[bmp pixelsWide], (int)[bmp pixelsHigh], [bmp bitmapData]);
     
+    // launched with -benchmark YES
+    if ([[NSUserDefaults standardUserDefaults] boolForKey:@"benchmark"]) {
+        img = [NSImage imageNamed:@"lenna"];
+        bmp = (NSBitmapImageRep *)[[img representations] objectAtIndex:0];
+        tex[2] = device_gen_texture(DEVICE_TEXTURE_TILED, (int)[bmp pixelsWide], (int)[bmp pixelsHigh], [bmp bitmapData]);
+        
+        img = [NSImage imageNamed:@"banana"];
+        bmp = (NSBitmapImageRep *)[[img representations] objectAtIndex:0];
+        tex[3] = device_gen_texture(DEVICE_TEXTURE_TILED, (int)[bmp pixelsWide], (int)[bmp pixelsHigh], [bmp bitmapData]);
+        
+        [self benchmark];
+        [self benchmarkMath];
+    }
+    
     [self draw];
 }
 
@@ -282,6 +321,140 @@
     [imageView setImage:image];
 }
 
+// texels per second of the textured quad and the banana turned through every orientation, with
+// the row-major textures in tex[0], tex[1] against their tiled copies in tex[2], tex[3].
+// one nearest texel per covered pixel, on a device of its own
+-(void)benchmark {
+    float vertex[] = {
+        -1.0f,  1.0f, 0.0f,
+        -1.0f, -1.0f, 0.0f,
+         1.0f, -1.0f, 0.0f,
+        
+        -1.0f,  1.0f, 0.0f,
+         1.0f, -1.0f, 0.0f,
+         1.0f,  1.0f, 0.0f
+    };
+    
+    float texcoord[] = {
+        0.0f, 1.0f,
+        0.0f, 0.0f,
+        1.0f, 0.0f,
+        
+        0.0f, 1.0f,
+        1.0f, 0.0f,
+        1.0f, 1.0f
+    };
+    
+    const int steps = 16;
+    device_t bench;
+    device_init_threads(&bench, width, height, (int)[[NSProcessInfo processInfo] activeProcessorCount]);
+    float eye[] = {0, 0, 3}, center[] = {0, 0, 0}, up[] = {0, 1, 0};
+    mat4_look_at(bench.transform.view, eye, center, up);
+    
+    for (int model = 0; model < 2; model++) {
+        if (model == 0) {
+            device_vertex_pointer(&bench, 6, vertex);
+            device_texcoord_pointer(&bench, texcoord);
+        }
+        else {
+            device_vertex_pointer(&bench, bananaNumVerts, bananaVerts);
+            device_texcoord_pointer(&bench, bananaTexCoords);
+        }
+        int count = model == 0 ? 6 : bananaNumVerts;
+        
+        for (int tiled = 0; tiled < 2; tiled++) {
+            device_bind_texture(&bench, tex[tiled * 2 + model]);
+            double seconds = 0, texels = 0;
+            
+            for (int i = 0; i < steps * steps; i++) {
+                float vy[] = {0, 1, 0, 0}, vx[] = {1, 0, 0, 0};
+                mat4_identity(bench.transform.model);
+                mat4_rotate(bench.transform.model, bench.transform.model, (i % steps) * 2 * M_PI / steps, vy);
+                mat4_rotate(bench.transform.model, bench.transform.model, (i / steps) * 2 * M_PI / steps, vx);
+                transform_update(&bench.transform);
+                device_clear(&bench);
+                
+                CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+                draw_arrays(&bench, 0, count);
+                seconds += CFAbsoluteTimeGetCurrent() - start;
+                
+                for (int p = 0; p < width * height; p++) {
+                    texels += bench.zbuffer[p] != 0;
+                }
+            }
+            
+            NSLog(@"%@ %@: %.1f Mtexels/s", model == 0 ? @"quad" : @"banana", tiled ? @"tiled" : @"rows", texels / seconds / 1e6);
+        }
+    }
+    
+    device_destroy(&bench);
+}
+
+// ns per matrix or vector of mat4_multiply, mat4_multiply_batch, mat4_apply and mat4_apply_batch
+// against the scalar code. the library picks AVX, SSE2 or scalar from the build flags, so the
+// AVX figures need the target built with -mavx. results have to match the scalar ones bit for bit
+-(void)benchmarkMath {
+    const int count = 1024, rounds = 2000;
+    float* a = (float*)malloc(16 * sizeof(float));
+    float* b = (float*)malloc(count * 16 * sizeof(float));
+    float* out = (float*)malloc(count * 16 * sizeof(float));
+    float* batched = (float*)malloc(count * 16 * sizeof(float));
+    float* expected = (float*)malloc(count * 16 * sizeof(float));
+    for (int i = 0; i < 16; i++) {
+        a[i] = (float)rand() / RAND_MAX - 0.5f;
+    }
+    for (int i = 0; i < count * 16; i++) {
+        b[i] = (float)rand() / RAND_MAX - 0.5f;
+    }
+    
+#if defined(__AVX__)
+    NSString* build = @"avx";
+#elif defined(__SSE2__)
+    NSString* build = @"sse2";
+#else
+    NSString* build = @"scalar";
+#endif
+    
+    // matrices, then vec4s over the same floats
+    for (int kind = 0; kind < 2; kind++) {
+        const int stride = kind == 0 ? 16 : 4, n = kind == 0 ? count : count * 4;
+        double seconds[3] = {0, 0, 0};
+        for (int r = 0; r < rounds; r++) {
+            CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+            for (int i = 0; i < n; i++) {
+                if (kind == 0) mat4_multiply_scalar(expected + i * stride, a, b + i * stride);
+                else mat4_apply_scalar(expected + i * stride, a, b + i * stride);
+            }
+            CFAbsoluteTime scalar = CFAbsoluteTimeGetCurrent();
+            for (int i = 0; i < n; i++) {
+                if (kind == 0) mat4_multiply(out + i * stride, a, b + i * stride);
+                else mat4_apply(out + i * stride, a, b + i * stride);
+            }
+            CFAbsoluteTime single = CFAbsoluteTimeGetCurrent();
+            if (kind == 0) mat4_multiply_batch(batched, a, b, n);
+            else mat4_apply_batch(batched, a, b, n);
+            CFAbsoluteTime batch = CFAbsoluteTimeGetCurrent();
+            seconds[0] += scalar - start;
+            seconds[1] += single - scalar;
+            seconds[2] += batch - single;
+        }
+        
+        // the single call and the batch results are each checked against the scalar ones
+        int single_mismatch = memcmp(out, expected, count * 16 * sizeof(float)) != 0;
+        int batch_mismatch = memcmp(batched, expected, count * 16 * sizeof(float)) != 0;
+        double ns = 1e9 / ((double)n * rounds);
+        NSLog(@"%@ %@: scalar %.1f ns, %@ %.1f ns%@, batch %.1f ns%@", kind == 0 ? @"mat4_multiply" : @"mat4_apply", kind == 0 ? @"per matrix" : @"per vec4",
+              seconds[0] * ns, build, seconds[1] * ns, single_mismatch ? @" (differs from scalar)" : @"",
+              seconds[2] * ns, batch_mismatch ? @" (differs from scalar)" : @"");
+    }
+    
+    free(a);
+    free(b);
+    free(out);
+    free(batched);
+    free(expected);
+}
+
 - (IBAction)btnPressed:(id)sender {
     if (sender == btnReset) {
         mat4_identity(device.transform.model);
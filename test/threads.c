@@ -0,0 +1,134 @@
+//
+//  threads.c
+//  SoftwareRender
+//
+//  Renders from several threads at once, one device_t each, sharing one texture and the vertex
+//  buffers, and checks every frame against the same frame rendered single threaded.
+//
+//  cc -O2 -Ilib -Isamples/SoftwareRenderer/models test/threads.c lib/renderer.c lib/mesh.c -lm -lpthread
+//  ./a.out [threads] [frames per thread]
+//
+
+#include "renderer.h"
+#include "ateneal.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VARIANTS 6
+
+static texture_t* texture;
+static buffer_t* statue_vertices;
+static buffer_t* statue_normals;
+static buffer_t* quad_vertices;
+static buffer_t* quad_normals;
+static buffer_t* quad_texcoords;
+
+static uint64_t reference[VARIANTS];
+static int frames = 20;
+static int mismatches;
+
+static uint64_t framebuffer_hash(const device_t* device) {
+    uint64_t h = 1469598103934665603ULL;
+    for (uint32_t i = 0; i < device->width * device->height; i++) {
+        h ^= device->framebuffer[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// one frame of the textured quad and the statue, variants differ in rotation, raster mode and
+// whether the device bins into tiles
+static uint64_t render(int variant) {
+    device_t device;
+    device_init_threads(&device, 320, 240, 1 + (variant & 1));
+    device_raster_mode(&device, variant % 3);
+
+    float vy[] = {0, 1, 0, 0};
+    mat4_identity(device.transform.model);
+    mat4_rotate(device.transform.model, device.transform.model, 0.3f * variant, vy);
+    transform_update(&device.transform);
+
+    float light[] = {0, 0, 10};
+    float color[] = {1, 1, 1, 1};
+    device_enable_light(&device, 1);
+    device_light(&device, light, color, 0.2, 0.5, 0.5, 50);
+    device_clear(&device);
+
+    device_vertex_buffer(&device, 6, quad_vertices);
+    device_normal_buffer(&device, quad_normals);
+    device_texcoord_buffer(&device, quad_texcoords);
+    device_bind_texture(&device, texture);
+    draw_arrays(&device, 0, 6);
+
+    device_vertex_buffer(&device, atenealNumVerts, statue_vertices);
+    device_normal_buffer(&device, statue_normals);
+    device_texcoord_buffer(&device, NULL);
+    device_bind_texture(&device, NULL);
+    draw_arrays(&device, 0, atenealNumVerts);
+
+    uint64_t h = framebuffer_hash(&device);
+    device_destroy(&device);
+    return h;
+}
+
+static void* worker(void* arg) {
+    long id = (long)arg;
+    for (int i = 0; i < frames; i++) {
+        int variant = (int)((id + i) % VARIANTS);
+        if (render(variant) != reference[variant]) {
+            __atomic_add_fetch(&mismatches, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (argc > 2) frames = atoi(argv[2]);
+
+    float quad[] = {-1, -1, 0, 1, -1, 0, 1, 1, 0, -1, -1, 0, 1, 1, 0, -1, 1, 0};
+    float normals[] = {0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1};
+    float texcoords[] = {0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1};
+
+    uint8_t* pixels = (uint8_t*)malloc(64 * 64 * 4);
+    for (int i = 0; i < 64 * 64; i++) {
+        pixels[i * 4] = i;
+        pixels[i * 4 + 1] = i >> 3;
+        pixels[i * 4 + 2] = i >> 6;
+        pixels[i * 4 + 3] = 255;
+    }
+    texture = device_gen_texture(DEVICE_TEXTURE_ROWS, 64, 64, pixels);
+    free(pixels);
+
+    statue_vertices = device_gen_buffer(atenealVerts, atenealNumVerts * 3 * sizeof(float));
+    statue_normals = device_gen_buffer(atenealNormals, atenealNumVerts * 3 * sizeof(float));
+    quad_vertices = device_gen_buffer(quad, sizeof(quad));
+    quad_normals = device_gen_buffer(normals, sizeof(normals));
+    quad_texcoords = device_gen_buffer(texcoords, sizeof(texcoords));
+
+    for (int i = 0; i < VARIANTS; i++) {
+        reference[i] = render(i);
+    }
+
+    pthread_t* workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    for (long i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, worker, (void*)i);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    // every device released its references, only the ones created above are left
+    int leaked = texture->refcount != 1 || statue_vertices->refcount != 1 || quad_texcoords->refcount != 1;
+    printf("%d threads x %d frames: %d mismatches%s\n", threads, frames, mismatches, leaked ? ", references leaked" : "");
+
+    device_del_texture(texture);
+    device_del_buffer(statue_vertices);
+    device_del_buffer(statue_normals);
+    device_del_buffer(quad_vertices);
+    device_del_buffer(quad_normals);
+    device_del_buffer(quad_texcoords);
+    return mismatches || leaked ? 1 : 0;
+}